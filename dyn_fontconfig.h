@@ -11,6 +11,31 @@
 #define FC_CHARSET "charset"      /* CharSet */
 #define FC_PIXEL_SIZE "pixelsize" /* Double */
 #define FC_FAMILY "family"        /* string */
+#define FC_INDEX "index"          /* Int */
+#define FC_ANTIALIAS "antialias"  /* Bool (depends) */
+#define FC_HINTING "hinting"      /* Bool (true) */
+#define FC_HINT_STYLE "hintstyle" /* Int */
+#define FC_RGBA "rgba"            /* Int */
+#define FC_EMBOLDEN "embolden"    /* Bool - true if emboldening needed*/
+#define FC_SPACING "spacing"      /* Int */
+
+#define FC_RGBA_UNKNOWN 0
+#define FC_RGBA_RGB 1
+#define FC_RGBA_BGR 2
+#define FC_RGBA_VRGB 3
+#define FC_RGBA_VBGR 4
+#define FC_RGBA_NONE 5
+
+#define FC_MONO 100
+#define FC_CHARCELL 110
+
+#define FC_HINT_NONE 0
+#define FC_HINT_SLIGHT 1
+#define FC_HINT_MEDIUM 2
+#define FC_HINT_FULL 3
+
+#define FC_CHARSET_MAP_SIZE (256 / 32)
+#define FC_CHARSET_DONE ((FcChar32)-1)
 
 typedef int FcBool;
 typedef unsigned char FcChar8;
@@ -20,6 +45,7 @@ typedef struct _FcCharSet FcCharSet;
 typedef struct _FcConfig FcConfig;
 typedef struct _FcPatern FcPattern;
 typedef struct _FcCharSet FcCharSet;
+typedef struct _FcStrList FcStrList;
 
 typedef enum _FcResult
 {
@@ -55,20 +81,35 @@ typedef enum _FcMatchKind
         return (const char *const)dlerror();
 
 DEFSYM(void, FcInit, void);
+DEFSYM(int, FcGetVersion, void);
+DEFSYM(FcStrList *, FcConfigGetConfigFiles, FcConfig *config);
+DEFSYM(FcStrList *, FcConfigGetFontDirs, FcConfig *config);
+DEFSYM(FcChar8 *, FcStrListNext, FcStrList *list);
+DEFSYM(void, FcStrListDone, FcStrList *list);
 DEFSYM(FcPattern *, FcNameParse, FcChar8 *name);
 DEFSYM(FcChar8 *, FcNameUnparse, FcPattern *p);
 DEFSYM(FcBool, FcConfigSubstitute, FcConfig *config, FcPattern *p, FcMatchKind kind);
 DEFSYM(void, FcDefaultSubstitute, FcPattern *p);
+DEFSYM(FcPattern *, FcFontMatch, FcConfig *config, FcPattern *p, FcResult *result);
+DEFSYM(FcFontSet *, FcFontSetCreate, void);
+DEFSYM(FcBool, FcFontSetAdd, FcFontSet *s, FcPattern *font);
+DEFSYM(FcPattern *, FcPatternDuplicate, const FcPattern *p);
 DEFSYM(FcFontSet *, FcFontSort, FcConfig *config, FcPattern *p, FcBool trim, FcCharSet **csp, FcResult *r);
 DEFSYM(FcResult, FcPatternGetCharSet, FcPattern *p, const char *object, int n, FcCharSet **c);
+DEFSYM(FcResult, FcPatternGetInteger, FcPattern *p, const char *object, int n, int *i);
+DEFSYM(FcResult, FcPatternGetBool, FcPattern *p, const char *object, int n, FcBool *b);
 DEFSYM(FcResult, FcPatternGetDouble, FcPattern *p, const char *object, int n, double *v);
 DEFSYM(FcResult, FcPatternGetString, FcPattern *p, const char *object, int n, FcChar8 **s);
 DEFSYM(FcResult, FcPatternAddDouble, FcPattern *p, const char *object, double d);
 DEFSYM(FcResult, FcPatternDel, FcPattern *p, const char *object);
 DEFSYM(FcChar32, FcPatternHash, const FcPattern *p);
 DEFSYM(void, FcPatternPrint, const FcPattern *p);
+DEFSYM(FcCharSet *, FcCharSetCreate, void);
+DEFSYM(FcBool, FcCharSetAddChar, FcCharSet *fcs, FcChar32 ucs4);
 DEFSYM(FcCharSet *, FcCharSetCopy, FcCharSet *src);
 DEFSYM(FcBool, FcCharSetHasChar, const FcCharSet *fcs, FcChar32 ucs4);
+DEFSYM(FcChar32, FcCharSetFirstPage, const FcCharSet *a, FcChar32 map[FC_CHARSET_MAP_SIZE], FcChar32 *next);
+DEFSYM(FcChar32, FcCharSetNextPage, const FcCharSet *a, FcChar32 map[FC_CHARSET_MAP_SIZE], FcChar32 *next);
 DEFSYM(FcPattern *, FcFontRenderPrepare, FcConfig *config, FcPattern *p, FcPattern *font);
 DEFSYM(void, FcPatternDestroy, FcPattern *p);
 DEFSYM(void, FcCharSetDestroy, FcCharSet *c);
@@ -88,12 +129,23 @@ static const char *const load_fontconfig()
     if (lib == NULL)
         return (const char *const)dlerror();
     LOADSYM(lib, FcInit);
+    LOADSYM(lib, FcGetVersion);
+    LOADSYM(lib, FcConfigGetConfigFiles);
+    LOADSYM(lib, FcConfigGetFontDirs);
+    LOADSYM(lib, FcStrListNext);
+    LOADSYM(lib, FcStrListDone);
     LOADSYM(lib, FcNameParse);
     LOADSYM(lib, FcNameUnparse);
     LOADSYM(lib, FcConfigSubstitute);
     LOADSYM(lib, FcDefaultSubstitute);
+    LOADSYM(lib, FcFontMatch);
+    LOADSYM(lib, FcFontSetCreate);
+    LOADSYM(lib, FcFontSetAdd);
+    LOADSYM(lib, FcPatternDuplicate);
     LOADSYM(lib, FcFontSort);
     LOADSYM(lib, FcPatternGetCharSet);
+    LOADSYM(lib, FcPatternGetInteger);
+    LOADSYM(lib, FcPatternGetBool);
     LOADSYM(lib, FcPatternGetDouble);
     LOADSYM(lib, FcPatternGetString);
     LOADSYM(lib, FcPatternDel);
@@ -101,8 +153,12 @@ static const char *const load_fontconfig()
     LOADSYM(lib, FcPatternAddDouble);
     LOADSYM(lib, FcPatternHash);
     LOADSYM(lib, FcFontRenderPrepare);
+    LOADSYM(lib, FcCharSetCreate);
+    LOADSYM(lib, FcCharSetAddChar);
     LOADSYM(lib, FcCharSetCopy);
     LOADSYM(lib, FcCharSetHasChar);
+    LOADSYM(lib, FcCharSetFirstPage);
+    LOADSYM(lib, FcCharSetNextPage);
     LOADSYM(lib, FcPatternDestroy);
     LOADSYM(lib, FcCharSetDestroy);
     LOADSYM(lib, FcFontSetDestroy);
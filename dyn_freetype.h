@@ -0,0 +1,59 @@
+#ifndef DYN_FREETYPE_H
+#define DYN_FREETYPE_H
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#ifdef FONTCONFIG_DYNAMIC
+
+/* ------------- SYMBOLS FROM freetype/freetype.h -------------*/
+
+// the headers already declare these functions, so the pointers get their own names
+#define FT_Init_FreeType dyn_FT_Init_FreeType
+#define FT_Done_FreeType dyn_FT_Done_FreeType
+#define FT_New_Face dyn_FT_New_Face
+#define FT_Done_Face dyn_FT_Done_Face
+#define FT_Set_Pixel_Sizes dyn_FT_Set_Pixel_Sizes
+#define FT_Get_Char_Index dyn_FT_Get_Char_Index
+#define FT_Get_First_Char dyn_FT_Get_First_Char
+#define FT_Get_Next_Char dyn_FT_Get_Next_Char
+#define FT_Load_Glyph dyn_FT_Load_Glyph
+
+DEFSYM(FT_Error, FT_Init_FreeType, FT_Library *alibrary);
+DEFSYM(FT_Error, FT_Done_FreeType, FT_Library library);
+DEFSYM(FT_Error, FT_New_Face, FT_Library library, const char *filepathname, FT_Long face_index, FT_Face *aface);
+DEFSYM(FT_Error, FT_Done_Face, FT_Face face);
+DEFSYM(FT_Error, FT_Set_Pixel_Sizes, FT_Face face, FT_UInt pixel_width, FT_UInt pixel_height);
+DEFSYM(FT_UInt, FT_Get_Char_Index, FT_Face face, FT_ULong charcode);
+DEFSYM(FT_ULong, FT_Get_First_Char, FT_Face face, FT_UInt *agindex);
+DEFSYM(FT_ULong, FT_Get_Next_Char, FT_Face face, FT_ULong char_code, FT_UInt *agindex);
+DEFSYM(FT_Error, FT_Load_Glyph, FT_Face face, FT_UInt glyph_index, FT_Int32 load_flags);
+
+/* ------------- SYMBOLS FROM freetype/freetype.h -------------*/
+
+static const char *const load_freetype()
+{
+    void *lib = NULL;
+    static const char *dlnames[] = {
+        "libfreetype.so",
+        "libfreetype.so.6",
+    };
+    for (int i = 0; i < (sizeof(dlnames) / sizeof(*dlnames)) && lib == NULL; i++)
+        lib = dlopen(dlnames[i], RTLD_LAZY | RTLD_GLOBAL);
+    if (lib == NULL)
+        return (const char *const)dlerror();
+    LOADSYM(lib, FT_Init_FreeType);
+    LOADSYM(lib, FT_Done_FreeType);
+    LOADSYM(lib, FT_New_Face);
+    LOADSYM(lib, FT_Done_Face);
+    LOADSYM(lib, FT_Set_Pixel_Sizes);
+    LOADSYM(lib, FT_Get_Char_Index);
+    LOADSYM(lib, FT_Get_First_Char);
+    LOADSYM(lib, FT_Get_Next_Char);
+    LOADSYM(lib, FT_Load_Glyph);
+    return NULL;
+}
+
+#endif
+
+#endif
@@ -0,0 +1,79 @@
+#!/usr/bin/env perl
+# Generates grapheme_table.h, the Grapheme_Cluster_Break and Extended_Pictographic
+# properties used to split text into extended grapheme clusters (UAX #29).
+# The Unicode version is the one of the Perl running the script.
+#
+#   perl gen_grapheme_table.pl > grapheme_table.h
+use strict;
+use warnings;
+use Unicode::UCD qw(prop_invmap prop_invlist);
+
+my @values = qw(Other CR LF Control Extend ZWJ Regional_Indicator Prepend SpacingMark L V T LV LVT);
+my %value_index = map { $values[$_] => $_ } 0 .. $#values;
+my $ext_pict = 0x10;
+my $block_shift = 7;
+my $block_size = 1 << $block_shift;
+
+my @props = (0) x 0x110000;
+my ($list, $map) = prop_invmap('Grapheme_Cluster_Break');
+for my $i (0 .. $#$list)
+{
+    my $value = $map->[$i];
+    $value = 'Other' unless exists $value_index{$value}; # perl folds ExtPict into GCB
+    my $end = $i < $#$list ? $list->[$i + 1] : 0x110000;
+    $props[$_] = $value_index{$value} for $list->[$i] .. $end - 1;
+}
+my @pict = prop_invlist('Extended_Pictographic');
+for (my $i = 0; $i < @pict; $i += 2)
+{
+    my $end = $i + 1 < @pict ? $pict[$i + 1] : 0x110000;
+    $props[$_] |= $ext_pict for $pict[$i] .. $end - 1;
+}
+
+my (@stage1, @blocks, %block_index);
+for (my $start = 0; $start < 0x110000; $start += $block_size)
+{
+    my $key = join(',', @props[$start .. $start + $block_size - 1]);
+    if (!exists $block_index{$key})
+    {
+        $block_index{$key} = scalar @blocks;
+        push @blocks, $key;
+    }
+    push @stage1, $block_index{$key};
+}
+die "too many blocks\n" if @blocks > 256;
+
+printf "// generated by gen_grapheme_table.pl from Unicode %s, do not edit\n", Unicode::UCD::UnicodeVersion();
+print "#ifndef LFC_GRAPHEME_TABLE_H\n#define LFC_GRAPHEME_TABLE_H\n\n";
+for my $i (0 .. $#values)
+{
+    printf "#define LFC_GCB_%s %d\n", uc($values[$i] eq 'Regional_Indicator' ? 'RI' : $values[$i]), $i;
+}
+printf "#define LFC_GCB_MASK 0x0f\n#define LFC_EXT_PICT 0x%02x\n", $ext_pict;
+printf "#define LFC_GCB_SHIFT %d\n\n", $block_shift;
+
+printf "static const unsigned char lfc_gcb_stage1[%d] = {\n", scalar @stage1;
+for (my $i = 0; $i < @stage1; $i += 16)
+{
+    my $last = $i + 15 < $#stage1 ? $i + 15 : $#stage1;
+    print "    ", join(', ', @stage1[$i .. $last]), ",\n";
+}
+print "};\n\n";
+
+printf "static const unsigned char lfc_gcb_stage2[%d][%d] = {\n", scalar @blocks, $block_size;
+for my $block (@blocks)
+{
+    my @block = split /,/, $block;
+    print "    {\n";
+    for (my $i = 0; $i < @block; $i += 32)
+    {
+        print "        ", join(',', @block[$i .. $i + 31]), ",\n";
+    }
+    print "    },\n";
+}
+print "};\n\n";
+
+print "static inline unsigned lfc_grapheme_props(unsigned codepoint)\n{\n";
+print "    if (codepoint >= 0x110000)\n        return LFC_GCB_OTHER;\n";
+print "    return lfc_gcb_stage2[lfc_gcb_stage1[codepoint >> LFC_GCB_SHIFT]][codepoint & ((1u << LFC_GCB_SHIFT) - 1)];\n}\n\n";
+print "#endif\n";
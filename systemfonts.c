@@ -1,7 +1,12 @@
+#include <math.h>
 #include <stddef.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600
+#endif
 #include <windows.h>
 #define LFC_EXPORT __declspec(dllexport)
 #else
@@ -9,422 +14,3620 @@
 #define _POSIX_C_SOURCE 200809L
 #endif
 #include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
 #define LFC_EXPORT
 #endif
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include "dyn_fontconfig.h"
+#include "dyn_freetype.h"
+#include "grapheme_table.h"
 
 #define LITE_XL_PLUGIN_ENTRYPOINT
 #include "lite_xl_plugin_api.h"
 
-#define LFC_FONT_CACHE "__LFC_FONT_CACHE__"
 #define LFC_FONT "__LFC_FONT_TABLE__"
 #define LFC_RENDERER "__LFC_RENDERER_TABLE__"
 
 #define LFC_TYPE_FCFONT "FcFont"
+#define LFC_TYPE_LAYOUT "TextLayout"
+#define LFC_TYPE_WIDTH_JOB "WidthJob"
+
+#ifdef _WIN32
+typedef CRITICAL_SECTION LFCMutex;
+typedef CONDITION_VARIABLE LFCCond;
+#define LFC_THREAD_FUNC(name) DWORD WINAPI name(LPVOID arg)
+#define LFC_THREAD_RETURN return 0
+
+static void lfc_mutex_init(LFCMutex *mutex) { InitializeCriticalSection(mutex); }
+static void lfc_mutex_destroy(LFCMutex *mutex) { DeleteCriticalSection(mutex); }
+static void lfc_mutex_lock(LFCMutex *mutex) { EnterCriticalSection(mutex); }
+static void lfc_mutex_unlock(LFCMutex *mutex) { LeaveCriticalSection(mutex); }
+static void lfc_cond_init(LFCCond *cond) { InitializeConditionVariable(cond); }
+static void lfc_cond_destroy(LFCCond *cond) { (void)cond; }
+static void lfc_cond_wait(LFCCond *cond, LFCMutex *mutex) { SleepConditionVariableCS(cond, mutex, INFINITE); }
+static void lfc_cond_broadcast(LFCCond *cond) { WakeAllConditionVariable(cond); }
+
+// starts a detached thread
+static int lfc_thread_start(LPTHREAD_START_ROUTINE func, void *arg)
+{
+    HANDLE thread = CreateThread(NULL, 0, func, arg, 0, NULL);
+    if (!thread)
+        return -1;
+    CloseHandle(thread);
+    return 0;
+}
+#else
+typedef pthread_mutex_t LFCMutex;
+typedef pthread_cond_t LFCCond;
+#define LFC_THREAD_FUNC(name) void *name(void *arg)
+#define LFC_THREAD_RETURN return NULL
+
+static void lfc_mutex_init(LFCMutex *mutex) { pthread_mutex_init(mutex, NULL); }
+static void lfc_mutex_destroy(LFCMutex *mutex) { pthread_mutex_destroy(mutex); }
+static void lfc_mutex_lock(LFCMutex *mutex) { pthread_mutex_lock(mutex); }
+static void lfc_mutex_unlock(LFCMutex *mutex) { pthread_mutex_unlock(mutex); }
+static void lfc_cond_init(LFCCond *cond) { pthread_cond_init(cond, NULL); }
+static void lfc_cond_destroy(LFCCond *cond) { pthread_cond_destroy(cond); }
+static void lfc_cond_wait(LFCCond *cond, LFCMutex *mutex) { pthread_cond_wait(cond, mutex); }
+static void lfc_cond_broadcast(LFCCond *cond) { pthread_cond_broadcast(cond); }
+
+// starts a detached thread
+static int lfc_thread_start(void *(*func)(void *), void *arg)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, func, arg) != 0)
+        return -1;
+    pthread_detach(thread);
+    return 0;
+}
+#endif
+
+// renderer functions resolved by setup(), stored as registry references
+typedef struct LFCCallbacks
+{
+    int draw_text, get_width, get_height, load, group;
+} LFCCallbacks;
+
+static LFCCallbacks callbacks = {LUA_NOREF, LUA_NOREF, LUA_NOREF, LUA_NOREF, LUA_NOREF};
+
+// number of codepoints covered by a coverage block, same as a fontconfig charset page
+#define LFC_COVERAGE_BLOCK 256
+#define LFC_COVERAGE_BLOCKS (0x110000 / LFC_COVERAGE_BLOCK)
+// returned by coverage_lookup() when no font in the chain covers a codepoint
+#define LFC_COVERAGE_NONE 0xFFFF
+
+// two-stage table mapping a codepoint to the first font in the chain that covers it
+typedef struct LFCCoverage
+{
+    unsigned short stage1[LFC_COVERAGE_BLOCKS];
+    unsigned short (*blocks)[LFC_COVERAGE_BLOCK];
+    int nblocks;
+} LFCCoverage;
+
+// number of fonts in the chain that are prepared when a font is loaded, the rest is prepared on demand
+#define LFC_EAGER_FONTS 4
+
+// resolved chains are cached on disk, a cache file contains an LFCChainHeader followed by
+// n LFCChainRecords, the coverage table of the whole chain, the charset pages and the strings.
+#define LFC_CHAIN_MAGIC "LFCC"
+#define LFC_CHAIN_VERSION 1
+
+typedef struct LFCChainHeader
+{
+    char magic[4];
+    unsigned version;
+    unsigned long long fingerprint; // fontconfig configuration the chain was resolved with
+    unsigned size, n, nblocks;
+    unsigned key_offset, key_length;
+    unsigned records_offset, coverage_offset;
+} LFCChainHeader;
+
+typedef struct LFCChainRecord
+{
+    unsigned pattern_offset, pattern_length; // unprepared font pattern, without its charset
+    unsigned pages_offset, npages;           // charset of the font
+} LFCChainRecord;
+
+typedef struct LFCChainPage
+{
+    FcChar32 base;
+    FcChar32 map[FC_CHARSET_MAP_SIZE];
+} LFCChainPage;
+
+// a memory-mapped cache file
+typedef struct LFCChainFile
+{
+    const char *data;
+    size_t size;
+#ifdef _WIN32
+    HANDLE file, mapping;
+#endif
+} LFCChainFile;
 
 typedef struct FcFont
 {
     FcPattern *base_pattern;
-    FcPattern **patterns;
-    FcCharSet **charsets;
+    FcFontSet *set;        // sorted fonts, NULL if the chain was loaded from the cache file
+    LFCChainFile *file;    // cache file the chain was loaded from
+    FcPattern **sources;   // unprepared patterns parsed from the cache file
+    FcPattern **patterns;  // render-ready patterns, NULL until the font is used
+    FcCharSet **charsets;  // charsets of the first covered fonts
+    LFCCoverage *coverage;
+    int covered;          // number of fonts included in the coverage table
+    struct LFCCacheEntry **entries; // renderer fonts of the chain, valid while entries_generation matches the cache
+    unsigned entries_generation;
     int n, tab_size;
+    int width_engine;       // LFC_WIDTH_*
+    int fallback_mode;      // LFC_FALLBACK_*
+    unsigned char *loadable; // see fcfont_loadable()
+    int monospace;          // the primary font is monospaced, see face_text_width()
+    unsigned generation;    // incremented whenever text may be laid out differently
+    struct LFCWidthCache *width_cache;
+    int ascii_primary;      // the primary font never breaks a run on ASCII text
+    unsigned *uses;         // number of segments measured or drawn with each font, see to_group()
+    int group_dirty;        // a font was used for the first time since the group was built
+    int group_max;          // max_fonts of the group stored in the user value
+    unsigned group_generation;
+    size_t texts, segments, max_segments; // see get_segment_stats()
+    struct LFCLoadJob *job; // pending load_async() work
 } FcFont;
 
-#define CLEANUP(L, ...)                  \
-    {                                    \
-        lua_pushfstring(L, __VA_ARGS__); \
-        goto cleanup;                    \
+static void fcfont_free(FcFont *font);
+static void chain_file_close(LFCChainFile *file);
+
+static int is_monospace(FcPattern *pattern)
+{
+    int spacing;
+    return FcPatternGetInteger(pattern, FC_SPACING, 0, &spacing) == FcResultMatch &&
+           (spacing == FC_MONO || spacing == FC_CHARCELL);
+}
+
+// lite-xl can only load the first face of a file, so TTC files are unusable as fallbacks
+static int is_loadable(FcPattern *pattern)
+{
+    const char *name;
+    size_t len;
+    if (FcPatternGetString(pattern, FC_FILE, 0, (FcChar8 **)&name) != FcResultMatch)
+        return 0;
+    len = strlen(name);
+    return len < 4 || strcmp(name + len - 4, ".ttc") != 0;
+}
+
+static unsigned block_hash(const unsigned short *block)
+{
+    unsigned hash = 2166136261u;
+    for (int i = 0; i < LFC_COVERAGE_BLOCK; i++)
+        hash = (hash ^ block[i]) * 16777619u;
+    return hash;
+}
+
+static void coverage_free(LFCCoverage *coverage)
+{
+    if (!coverage)
+        return;
+    free(coverage->blocks);
+    free(coverage);
+}
+
+// builds the coverage table of the first n fonts in the chain.
+// the primary font is always included, other fonts are only included if lite-xl can load them.
+static LFCCoverage *coverage_build(FcPattern **patterns, FcCharSet **charsets, int n)
+{
+    LFCCoverage *coverage = NULL;
+    unsigned short **pages = NULL;
+    int *slots = NULL, nslots = 0;
+    int npages = 0;
+
+    if (n > LFC_COVERAGE_NONE)
+        n = LFC_COVERAGE_NONE;
+    coverage = calloc(1, sizeof(LFCCoverage));
+    pages = calloc(LFC_COVERAGE_BLOCKS, sizeof(unsigned short *));
+    if (!coverage || !pages)
+        goto fail;
+
+    // expand the charsets into full pages of font indices, lower indices take priority
+    for (int i = 0; i < n; i++)
+    {
+        FcChar32 map[FC_CHARSET_MAP_SIZE], next;
+        if (!charsets[i] || (i > 0 && !is_loadable(patterns[i])))
+            continue;
+        for (FcChar32 base = FcCharSetFirstPage(charsets[i], map, &next);
+             base != FC_CHARSET_DONE;
+             base = FcCharSetNextPage(charsets[i], map, &next))
+        {
+            unsigned short *page;
+            if (base >= 0x110000)
+                break;
+            page = pages[base / LFC_COVERAGE_BLOCK];
+            if (!page)
+            {
+                page = malloc(sizeof(unsigned short) * LFC_COVERAGE_BLOCK);
+                if (!page)
+                    goto fail;
+                for (int j = 0; j < LFC_COVERAGE_BLOCK; j++)
+                    page[j] = LFC_COVERAGE_NONE;
+                pages[base / LFC_COVERAGE_BLOCK] = page;
+                npages++;
+            }
+            for (int w = 0; w < FC_CHARSET_MAP_SIZE; w++)
+            {
+                for (FcChar32 bits = map[w]; bits; bits &= bits - 1)
+                {
+                    int j = w * 32 + __builtin_ctz(bits);
+                    if (page[j] == LFC_COVERAGE_NONE)
+                        page[j] = i;
+                }
+            }
+        }
+    }
+
+    // deduplicate the pages, block 0 is reserved for codepoints that no font covers
+    coverage->blocks = malloc(sizeof(*coverage->blocks) * (npages + 1));
+    for (nslots = 64; nslots < npages * 2; nslots *= 2)
+        ;
+    slots = malloc(sizeof(int) * nslots);
+    if (!coverage->blocks || !slots)
+        goto fail;
+    for (int i = 0; i < nslots; i++)
+        slots[i] = -1;
+    for (int j = 0; j < LFC_COVERAGE_BLOCK; j++)
+        coverage->blocks[0][j] = LFC_COVERAGE_NONE;
+    coverage->nblocks = 1;
+    for (int i = 0; i < LFC_COVERAGE_BLOCKS; i++)
+    {
+        unsigned slot;
+        if (!pages[i])
+            continue;
+        for (slot = block_hash(pages[i]) & (nslots - 1); slots[slot] != -1; slot = (slot + 1) & (nslots - 1))
+        {
+            if (memcmp(coverage->blocks[slots[slot]], pages[i], sizeof(*coverage->blocks)) == 0)
+                break;
+        }
+        if (slots[slot] == -1)
+        {
+            memcpy(coverage->blocks[coverage->nblocks], pages[i], sizeof(*coverage->blocks));
+            slots[slot] = coverage->nblocks++;
+        }
+        coverage->stage1[i] = slots[slot];
+    }
+
+    for (int i = 0; i < LFC_COVERAGE_BLOCKS; i++)
+        free(pages[i]);
+    free(pages);
+    free(slots);
+    return coverage;
+
+fail:
+    if (pages)
+    {
+        for (int i = 0; i < LFC_COVERAGE_BLOCKS; i++)
+            free(pages[i]);
+        free(pages);
     }
+    free(slots);
+    coverage_free(coverage);
+    return NULL;
+}
 
-static int f_load(lua_State *L)
+static inline unsigned coverage_lookup(const LFCCoverage *coverage, unsigned codepoint)
 {
-    const char *name = luaL_checkstring(L, 1);
-    FcResult result;
-    FcFontSet *set = NULL;
-    FcPattern *base_pattern = NULL;
-    FcPattern **final_patterns = NULL;
-    FcCharSet **final_charsets = NULL;
+    if (codepoint >= 0x110000)
+        return LFC_COVERAGE_NONE;
+    return coverage->blocks[coverage->stage1[codepoint / LFC_COVERAGE_BLOCK]][codepoint % LFC_COVERAGE_BLOCK];
+}
+
+// checks if runs in the primary font can skip over ASCII text without looking at it
+static int coverage_ascii_primary(const LFCCoverage *coverage)
+{
+    for (unsigned c = 0; c < 0x80; c++)
+    {
+        unsigned first = coverage_lookup(coverage, c);
+        if (first != 0 && first != LFC_COVERAGE_NONE)
+            return 0;
+    }
+    return 1;
+}
+
+// returns a copy of the charset requested by the base pattern, or the charset of the font
+static FcCharSet *get_charset(FcPattern *base_pattern, FcPattern *pattern)
+{
+    FcCharSet *s;
+    if (FcPatternGetCharSet(base_pattern, FC_CHARSET, 0, &s) != FcResultMatch &&
+        FcPatternGetCharSet(pattern, FC_CHARSET, 0, &s) != FcResultMatch)
+        return NULL;
+    return FcCharSetCopy(s);
+}
+
+static const LFCChainRecord *chain_file_record(const LFCChainFile *file, int i)
+{
+    const LFCChainHeader *header = (const LFCChainHeader *)file->data;
+    return (const LFCChainRecord *)(file->data + header->records_offset) + i;
+}
+
+// returns the unprepared pattern of a font in the chain
+static FcPattern *fcfont_source(FcFont *fc, int i)
+{
+    if (fc->set)
+        return fc->set->fonts[i];
+    if (!fc->sources[i])
+        fc->sources[i] = FcNameParse((FcChar8 *)fc->file->data + chain_file_record(fc->file, i)->pattern_offset);
+    return fc->sources[i];
+}
 
-    base_pattern = FcNameParse((FcChar8 *)name);
-    if (!base_pattern)
-        CLEANUP(L, "%s: cannot lookup font", name);
-    if (!FcConfigSubstitute(NULL, base_pattern, FcMatchPattern))
-        CLEANUP(L, "%s: cannot perform config substitution", name);
-    FcDefaultSubstitute(base_pattern);
+// whether the renderer can load the i-th font of the chain, remembered as 1 if it can and 2 if not
+static int fcfont_loadable(FcFont *fc, int i)
+{
+    if (!fc->loadable && !(fc->loadable = calloc(1, fc->n)))
+        return 0;
+    if (!fc->loadable[i])
+    {
+        FcPattern *source = fc->set || fc->file ? fcfont_source(fc, i) : NULL;
+        fc->loadable[i] = i == 0 || (source && is_loadable(source)) ? 1 : 2;
+    }
+    return fc->loadable[i] == 1;
+}
 
-    if (lua_isnumber(L, 2))
+static FcCharSet *fcfont_charset(FcFont *fc, int i)
+{
+    if (fc->charsets[i])
+        return fc->charsets[i];
+    if (fc->set)
     {
-        // if a number is specified, override the pixel size in pattern string
-        FcPatternDel(base_pattern, FC_PIXEL_SIZE);
-        FcPatternAddDouble(base_pattern, FC_PIXEL_SIZE, lua_tonumber(L, 2));
+        fc->charsets[i] = get_charset(fc->base_pattern, fc->set->fonts[i]);
+    }
+    else if ((fc->charsets[i] = FcCharSetCreate()))
+    {
+        const LFCChainRecord *record = chain_file_record(fc->file, i);
+        const LFCChainPage *pages = (const LFCChainPage *)(fc->file->data + record->pages_offset);
+        for (unsigned p = 0; p < record->npages; p++)
+        {
+            for (int w = 0; w < FC_CHARSET_MAP_SIZE; w++)
+            {
+                for (FcChar32 bits = pages[p].map[w]; bits; bits &= bits - 1)
+                    FcCharSetAddChar(fc->charsets[i], pages[p].base + w * 32 + __builtin_ctz(bits));
+            }
+        }
     }
+    return fc->charsets[i];
+}
 
-    set = FcFontSort(NULL, base_pattern, 1, NULL, &result);
-    if (result != FcResultMatch)
-        CLEANUP(L, "%s: cannot match font", name);
+// checks if the i-th font has a codepoint. the pages of a cached chain are searched in place,
+// so that asking does not build the charset.
+static int fcfont_has_char(FcFont *fc, int i, unsigned codepoint)
+{
+    const LFCChainRecord *record;
+    const LFCChainPage *pages;
+    unsigned base = codepoint & ~0xFFu, lo = 0, hi;
+    if (fc->charsets[i] || !fc->file)
+        return FcCharSetHasChar(fcfont_charset(fc, i), codepoint);
+    record = chain_file_record(fc->file, i);
+    pages = (const LFCChainPage *)(fc->file->data + record->pages_offset);
+    // pages are written in ascending order
+    for (hi = record->npages; lo < hi;)
+    {
+        unsigned mid = lo + (hi - lo) / 2;
+        if (pages[mid].base < base)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < record->npages && pages[lo].base == base && (pages[lo].map[(codepoint & 0xFF) >> 5] >> (codepoint & 31)) & 1;
+}
 
-    final_patterns = calloc(sizeof(FcPattern *), set->nfont);
-    final_charsets = calloc(sizeof(FcCharSet *), set->nfont);
-    if (!final_patterns || !final_charsets)
-        CLEANUP(L, "%s: cannot allocate memory", name);
+static FcPattern *fcfont_pattern(FcFont *fc, int i)
+{
+    FcPattern *source;
+    if (!fc->patterns[i] && (source = fcfont_source(fc, i)))
+        fc->patterns[i] = FcFontRenderPrepare(NULL, fc->base_pattern, source);
+    return fc->patterns[i];
+}
 
-    for (int i = 0; i < set->nfont; i++)
+// adds fonts to the coverage table until one covers the codepoint, returns the new lookup result.
+// control characters are never rendered by lite-xl, so they do not pull more fonts in.
+static unsigned fcfont_extend(FcFont *fc, unsigned codepoint)
+{
+    int covered = fc->covered;
+    LFCCoverage *coverage;
+    if (codepoint < 0x20 || (codepoint >= 0x7f && codepoint < 0xa0))
+        return LFC_COVERAGE_NONE;
+    while (covered < fc->n)
     {
-        final_patterns[i] = FcFontRenderPrepare(NULL, base_pattern, set->fonts[i]);
-        if (!final_patterns[i])
-            CLEANUP(L, "%s: cannot create final pattern", name);
-        FcCharSet *s;
-        if (FcPatternGetCharSet(base_pattern, FC_CHARSET, 0, &s) != FcResultMatch && FcPatternGetCharSet(final_patterns[i], FC_CHARSET, 0, &s) != FcResultMatch)
-            CLEANUP(L, "%s: cannot get charset", name);
+        int i = covered++;
+        if (fcfont_charset(fc, i) && FcCharSetHasChar(fc->charsets[i], codepoint) && is_loadable(fc->set->fonts[i]))
+            break;
+    }
+    coverage = coverage_build(fc->set->fonts, fc->charsets, covered);
+    if (!coverage)
+        return LFC_COVERAGE_NONE;
+    coverage_free(fc->coverage);
+    fc->coverage = coverage;
+    fc->covered = covered;
+    return coverage_lookup(coverage, codepoint);
+}
+
+// adds every remaining font of the chain to the coverage table, returns -1 if the table cannot be built
+static int fcfont_extend_all(FcFont *fc)
+{
+    LFCCoverage *coverage;
+    if (fc->covered == fc->n)
+        return 0;
+    for (int i = fc->covered; i < fc->n; i++)
+        fcfont_charset(fc, i);
+    coverage = coverage_build(fc->set->fonts, fc->charsets, fc->n);
+    if (!coverage)
+        return -1;
+    coverage_free(fc->coverage);
+    fc->coverage = coverage;
+    fc->covered = fc->n;
+    return 0;
+}
 
-        final_charsets[i] = FcCharSetCopy(s);
+static inline unsigned fcfont_lookup(FcFont *fc, unsigned codepoint)
+{
+    unsigned first = coverage_lookup(fc->coverage, codepoint);
+    if (first == LFC_COVERAGE_NONE && fc->covered < fc->n)
+        first = fcfont_extend(fc, codepoint);
+    return first;
+}
+
+static FcPattern *get_base_pattern(const char *name, int has_size, double size, const char **error)
+{
+    FcPattern *pattern = FcNameParse((FcChar8 *)name);
+    if (!pattern)
+    {
+        *error = "cannot lookup font";
+        return NULL;
+    }
+    if (!FcConfigSubstitute(NULL, pattern, FcMatchPattern))
+    {
+        *error = "cannot perform config substitution";
+        FcPatternDestroy(pattern);
+        return NULL;
+    }
+    FcDefaultSubstitute(pattern);
+    if (has_size)
+    {
+        // if a number is specified, override the pixel size in pattern string
+        FcPatternDel(pattern, FC_PIXEL_SIZE);
+        FcPatternAddDouble(pattern, FC_PIXEL_SIZE, size);
     }
+    return pattern;
+}
 
-    FcFont *font = lua_newuserdata(L, sizeof(FcFont));
-    luaL_setmetatable(L, LFC_TYPE_FCFONT);
+// builds the fallback chain of a base pattern from its sorted fonts, taking ownership of both.
+// this does not touch the Lua state, so it is safe to call from worker threads.
+static const char *fcfont_init(FcFont *font, FcPattern *base_pattern, FcFontSet *set)
+{
+    const char *error = NULL;
+    int covered = set->nfont < LFC_EAGER_FONTS ? set->nfont : LFC_EAGER_FONTS;
+
+    memset(font, 0, sizeof(FcFont));
     font->base_pattern = base_pattern;
-    font->charsets = final_charsets;
-    font->patterns = final_patterns;
+    font->set = set;
     font->n = set->nfont;
     font->tab_size = -1;
-    FcFontSetDestroy(set);
+    font->patterns = calloc(sizeof(FcPattern *), set->nfont);
+    font->charsets = calloc(sizeof(FcCharSet *), set->nfont);
+    font->entries = calloc(sizeof(struct LFCCacheEntry *), set->nfont);
+    if (!font->patterns || !font->charsets || !font->entries)
+    {
+        error = "cannot allocate memory";
+        goto cleanup;
+    }
+
+    for (int i = 0; i < covered; i++)
+    {
+        font->patterns[i] = FcFontRenderPrepare(NULL, base_pattern, set->fonts[i]);
+        if (!font->patterns[i])
+        {
+            error = "cannot create final pattern";
+            goto cleanup;
+        }
+        font->charsets[i] = get_charset(base_pattern, set->fonts[i]);
+        if (!font->charsets[i])
+        {
+            error = "cannot get charset";
+            goto cleanup;
+        }
+    }
+
+    font->coverage = coverage_build(set->fonts, font->charsets, covered);
+    if (!font->coverage)
+    {
+        error = "cannot build coverage table";
+        goto cleanup;
+    }
+    font->covered = covered;
+    // make sure that ASCII is covered by the same fonts as if the whole chain was loaded
+    for (unsigned c = 0x20; c < 0x7f; c++)
+        fcfont_lookup(font, c);
+    font->ascii_primary = coverage_ascii_primary(font->coverage);
+    font->monospace = is_monospace(font->patterns[0]);
+    return NULL;
+cleanup:
+    fcfont_free(font);
+    return error;
+}
+
+static int chain_cache_enabled = 1;
+
+static unsigned long long fnv64(unsigned long long hash, const void *data, size_t len)
+{
+    for (const unsigned char *p = data; len--; p++)
+        hash = (hash ^ *p) * 0x100000001b3ull;
+    return hash;
+}
+
+static unsigned long long fingerprint_files(unsigned long long hash, FcStrList *list)
+{
+    struct stat st;
+    if (!list)
+        return hash;
+    for (FcChar8 *path; (path = FcStrListNext(list));)
+    {
+        long long info[2] = {0, 0};
+        if (stat((const char *)path, &st) == 0)
+        {
+            info[0] = st.st_mtime;
+            info[1] = st.st_size;
+        }
+        hash = fnv64(hash, path, strlen((const char *)path));
+        hash = fnv64(hash, info, sizeof(info));
+    }
+    FcStrListDone(list);
+    return hash;
+}
+
+// fingerprints the fontconfig configuration, a font directory changes whenever fonts are added or removed
+static unsigned long long get_fingerprint(void)
+{
+    int version = FcGetVersion();
+    unsigned long long hash = fnv64(0xcbf29ce484222325ull, &version, sizeof(version));
+    hash = fingerprint_files(hash, FcConfigGetConfigFiles(NULL));
+    hash = fingerprint_files(hash, FcConfigGetFontDirs(NULL));
+    return hash;
+}
+
+static int get_chain_path(char *path, size_t size, const char *key)
+{
+    const char *dir;
+    size_t len;
+#ifdef _WIN32
+    if (!(dir = getenv("LOCALAPPDATA")))
+        return -1;
+    len = snprintf(path, size, "%s\\lite-xl-systemfonts", dir);
+    CreateDirectoryA(path, NULL);
+#else
+    if ((dir = getenv("XDG_CACHE_HOME")) && *dir)
+        len = snprintf(path, size, "%s", dir);
+    else if ((dir = getenv("HOME")))
+        len = snprintf(path, size, "%s/.cache", dir);
+    else
+        return -1;
+    mkdir(path, 0755);
+    len += snprintf(path + len, size - len, "/lite-xl-systemfonts");
+    mkdir(path, 0755);
+#endif
+    len += snprintf(path + len, size - len, "/%016llx.cache", fnv64(0xcbf29ce484222325ull, key, strlen(key)));
+    return len < size ? 0 : -1;
+}
+
+static void chain_file_close(LFCChainFile *file)
+{
+    if (!file)
+        return;
+#ifdef _WIN32
+    UnmapViewOfFile(file->data);
+    CloseHandle(file->mapping);
+    CloseHandle(file->file);
+#else
+    munmap((void *)file->data, file->size);
+#endif
+    free(file);
+}
+
+static LFCChainFile *chain_file_open(const char *path)
+{
+    LFCChainFile *file = calloc(1, sizeof(LFCChainFile));
+    if (!file)
+        return NULL;
+#ifdef _WIN32
+    LARGE_INTEGER size;
+    file->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, 0, NULL);
+    if (file->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file->file, &size) || size.QuadPart == 0)
+        goto fail;
+    file->size = size.QuadPart;
+    file->mapping = CreateFileMappingA(file->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!file->mapping || !(file->data = MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0)))
+        goto fail;
+    return file;
+fail:
+    if (file->mapping)
+        CloseHandle(file->mapping);
+    if (file->file != INVALID_HANDLE_VALUE)
+        CloseHandle(file->file);
+    free(file);
+    return NULL;
+#else
+    struct stat st;
+    void *data = MAP_FAILED;
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (fd >= 0)
+        close(fd);
+    if (data == MAP_FAILED)
+    {
+        free(file);
+        return NULL;
+    }
+    file->data = data;
+    file->size = st.st_size;
+    return file;
+#endif
+}
+
+static int chain_range_valid(const LFCChainFile *file, unsigned offset, size_t length, size_t align)
+{
+    return offset % align == 0 && offset <= file->size && length <= file->size - offset;
+}
+
+// checks that a cache file is complete and belongs to the key and configuration
+static int chain_file_valid(const LFCChainFile *file, const char *key, unsigned long long fingerprint)
+{
+    const LFCChainHeader *header = (const LFCChainHeader *)file->data;
+    const unsigned short *stage1, *blocks;
+    if (file->size < sizeof(LFCChainHeader) || memcmp(header->magic, LFC_CHAIN_MAGIC, 4) != 0 ||
+        header->version != LFC_CHAIN_VERSION || header->size != file->size ||
+        header->fingerprint != fingerprint || header->n == 0 || header->n > LFC_COVERAGE_NONE || header->nblocks == 0)
+        return 0;
+    if (!chain_range_valid(file, header->key_offset, header->key_length, 1) ||
+        header->key_length != strlen(key) || memcmp(file->data + header->key_offset, key, header->key_length) != 0)
+        return 0;
+    if (!chain_range_valid(file, header->records_offset, sizeof(LFCChainRecord) * (size_t)header->n, 4) ||
+        !chain_range_valid(file, header->coverage_offset, sizeof(unsigned short) * ((size_t)LFC_COVERAGE_BLOCKS + (size_t)header->nblocks * LFC_COVERAGE_BLOCK), 2))
+        return 0;
+    for (unsigned i = 0; i < header->n; i++)
+    {
+        const LFCChainRecord *record = chain_file_record(file, i);
+        if (!chain_range_valid(file, record->pattern_offset, (size_t)record->pattern_length + 1, 1) ||
+            file->data[(size_t)record->pattern_offset + record->pattern_length] != '\0' ||
+            !chain_range_valid(file, record->pages_offset, sizeof(LFCChainPage) * (size_t)record->npages, 4))
+            return 0;
+    }
+    stage1 = (const unsigned short *)(file->data + header->coverage_offset);
+    blocks = stage1 + LFC_COVERAGE_BLOCKS;
+    for (int i = 0; i < LFC_COVERAGE_BLOCKS; i++)
+    {
+        if (stage1[i] >= header->nblocks)
+            return 0;
+    }
+    for (size_t i = 0; i < (size_t)header->nblocks * LFC_COVERAGE_BLOCK; i++)
+    {
+        if (blocks[i] >= header->n && blocks[i] != LFC_COVERAGE_NONE)
+            return 0;
+    }
     return 1;
+}
+
+// loads a chain from its cache file, the base pattern is only taken over on success
+static int chain_cache_load(FcFont *font, FcPattern *base_pattern, const char *key, unsigned long long fingerprint)
+{
+    char path[4096];
+    const LFCChainHeader *header;
+    LFCChainFile *file;
+    if (get_chain_path(path, sizeof(path), key) != 0 || !(file = chain_file_open(path)))
+        return -1;
+    if (!chain_file_valid(file, key, fingerprint))
+    {
+        chain_file_close(file);
+        return -1;
+    }
+    header = (const LFCChainHeader *)file->data;
+
+    memset(font, 0, sizeof(FcFont));
+    font->file = file;
+    font->n = header->n;
+    font->covered = header->n;
+    font->tab_size = -1;
+    font->sources = calloc(sizeof(FcPattern *), font->n);
+    font->patterns = calloc(sizeof(FcPattern *), font->n);
+    font->charsets = calloc(sizeof(FcCharSet *), font->n);
+    font->entries = calloc(sizeof(struct LFCCacheEntry *), font->n);
+    font->coverage = calloc(1, sizeof(LFCCoverage));
+    if (!font->sources || !font->patterns || !font->charsets || !font->entries || !font->coverage ||
+        !(font->coverage->blocks = malloc(sizeof(*font->coverage->blocks) * header->nblocks)))
+        goto fail;
+    memcpy(font->coverage->stage1, file->data + header->coverage_offset, sizeof(font->coverage->stage1));
+    memcpy(font->coverage->blocks, file->data + header->coverage_offset + sizeof(font->coverage->stage1),
+           sizeof(*font->coverage->blocks) * header->nblocks);
+    font->coverage->nblocks = header->nblocks;
+    font->base_pattern = base_pattern;
+    if (!fcfont_pattern(font, 0))
+    {
+        font->base_pattern = NULL;
+        goto fail;
+    }
+    font->ascii_primary = coverage_ascii_primary(font->coverage);
+    font->monospace = is_monospace(font->patterns[0]);
+    return 0;
+fail:
+    fcfont_free(font);
+    return -1;
+}
+
+// writes the whole chain of a freshly sorted font to its cache file
+static void chain_cache_save(FcFont *font, const char *key, unsigned long long fingerprint)
+{
+    char path[4096], tmp_path[4096 + 32];
+    FcChar8 **texts = NULL;
+    FcCharSet **charsets = NULL;
+    LFCCoverage *coverage = NULL;
+    LFCChainHeader *header;
+    char *data = NULL;
+    size_t size, npages = 0, text_size = 0, offset;
+    FILE *fp;
+
+    if (get_chain_path(path, sizeof(path), key) != 0)
+        return;
+    texts = calloc(sizeof(FcChar8 *), font->n);
+    charsets = calloc(sizeof(FcCharSet *), font->n);
+    if (!texts || !charsets)
+        goto cleanup;
+    for (int i = 0; i < font->n; i++)
+    {
+        FcChar32 map[FC_CHARSET_MAP_SIZE], next;
+        FcPattern *pattern = FcPatternDuplicate(font->set->fonts[i]);
+        if (!pattern)
+            goto cleanup;
+        FcPatternDel(pattern, FC_CHARSET);
+        texts[i] = FcNameUnparse(pattern);
+        FcPatternDestroy(pattern);
+        charsets[i] = get_charset(font->base_pattern, font->set->fonts[i]);
+        if (!texts[i] || !charsets[i])
+            goto cleanup;
+        text_size += strlen((const char *)texts[i]) + 1;
+        for (FcChar32 base = FcCharSetFirstPage(charsets[i], map, &next);
+             base != FC_CHARSET_DONE && base < 0x110000;
+             base = FcCharSetNextPage(charsets[i], map, &next))
+            npages++;
+    }
+    if (!(coverage = coverage_build(font->set->fonts, charsets, font->n)))
+        goto cleanup;
+
+    size = sizeof(LFCChainHeader) + sizeof(LFCChainRecord) * font->n + sizeof(coverage->stage1) +
+           sizeof(*coverage->blocks) * coverage->nblocks + sizeof(LFCChainPage) * npages + strlen(key) + text_size;
+    if (size > 0xffffffffu || !(data = calloc(1, size)))
+        goto cleanup;
+    header = (LFCChainHeader *)data;
+    memcpy(header->magic, LFC_CHAIN_MAGIC, 4);
+    header->version = LFC_CHAIN_VERSION;
+    header->fingerprint = fingerprint;
+    header->size = size;
+    header->n = font->n;
+    header->nblocks = coverage->nblocks;
+    header->records_offset = sizeof(LFCChainHeader);
+    header->coverage_offset = header->records_offset + sizeof(LFCChainRecord) * font->n;
+    memcpy(data + header->coverage_offset, coverage->stage1, sizeof(coverage->stage1));
+    memcpy(data + header->coverage_offset + sizeof(coverage->stage1), coverage->blocks, sizeof(*coverage->blocks) * coverage->nblocks);
+    offset = header->coverage_offset + sizeof(coverage->stage1) + sizeof(*coverage->blocks) * coverage->nblocks;
+    for (int i = 0; i < font->n; i++)
+    {
+        LFCChainRecord *record = (LFCChainRecord *)(data + header->records_offset) + i;
+        LFCChainPage *page = (LFCChainPage *)(data + offset);
+        FcChar32 next;
+        record->pages_offset = offset;
+        for (FcChar32 base = FcCharSetFirstPage(charsets[i], page->map, &next);
+             base != FC_CHARSET_DONE && base < 0x110000;
+             base = FcCharSetNextPage(charsets[i], page->map, &next))
+        {
+            page->base = base;
+            page++;
+            record->npages++;
+        }
+        offset += sizeof(LFCChainPage) * record->npages;
+    }
+    header->key_offset = offset;
+    header->key_length = strlen(key);
+    memcpy(data + offset, key, header->key_length);
+    offset += header->key_length;
+    for (int i = 0; i < font->n; i++)
+    {
+        LFCChainRecord *record = (LFCChainRecord *)(data + header->records_offset) + i;
+        record->pattern_offset = offset;
+        record->pattern_length = strlen((const char *)texts[i]);
+        memcpy(data + offset, texts[i], record->pattern_length + 1);
+        offset += record->pattern_length + 1;
+    }
+
+    // write to a temporary file first, so that readers never see a partial file
+#ifdef _WIN32
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%lu.tmp", path, (unsigned long)GetCurrentThreadId());
+#else
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%ld.%p.tmp", path, (long)getpid(), (void *)font);
+#endif
+    if (!(fp = fopen(tmp_path, "wb")))
+        goto cleanup;
+    if (fwrite(data, 1, size, fp) != size)
+    {
+        fclose(fp);
+        remove(tmp_path);
+        goto cleanup;
+    }
+    fclose(fp);
+#ifdef _WIN32
+    if (!MoveFileExA(tmp_path, path, MOVEFILE_REPLACE_EXISTING))
+#else
+    if (rename(tmp_path, path) != 0)
+#endif
+        remove(tmp_path);
+
 cleanup:
-    if (final_patterns)
+    for (int i = 0; i < font->n; i++)
     {
-        for (FcPattern **pp = final_patterns; *pp; pp++)
-            FcPatternDestroy(*pp);
-        free(final_patterns);
+        if (texts && texts[i])
+            free(texts[i]);
+        if (charsets && charsets[i])
+            FcCharSetDestroy(charsets[i]);
     }
-    if (final_charsets)
+    free(texts);
+    free(charsets);
+    coverage_free(coverage);
+    free(data);
+}
+
+// resolves the fallback chain of a base pattern, taking ownership of it.
+// with primary_only, only the best match is resolved, which is a lot cheaper than sorting every font.
+static const char *fcfont_load(FcFont *font, FcPattern *base_pattern, int primary_only)
+{
+    FcResult result = FcResultNoMatch;
+    FcFontSet *set = NULL;
+    FcChar8 *key = NULL;
+    unsigned long long fingerprint = 0;
+    const char *error;
+    if (primary_only)
     {
-        for (FcCharSet **ss = final_charsets; *ss; ss++)
-            FcCharSetDestroy(*ss);
-        free(final_charsets);
+        FcPattern *match = FcFontMatch(NULL, base_pattern, &result);
+        if (match && (!(set = FcFontSetCreate()) || !FcFontSetAdd(set, match)))
+        {
+            FcPatternDestroy(match);
+            result = FcResultOutOfMemory;
+        }
+    }
+    else
+    {
+        if (chain_cache_enabled && (key = FcNameUnparse(base_pattern)))
+        {
+            fingerprint = get_fingerprint();
+            if (chain_cache_load(font, base_pattern, (const char *)key, fingerprint) == 0)
+            {
+                free(key);
+                return NULL;
+            }
+        }
+        set = FcFontSort(NULL, base_pattern, 1, NULL, &result);
+    }
+    if (result != FcResultMatch || !set || set->nfont == 0)
+    {
+        if (set)
+            FcFontSetDestroy(set);
+        FcPatternDestroy(base_pattern);
+        free(key);
+        return "cannot match font";
+    }
+    error = fcfont_init(font, base_pattern, set);
+    if (!error && key)
+        chain_cache_save(font, (const char *)key, fingerprint);
+    free(key);
+    return error;
+}
+
+static int f_load(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    const char *error = NULL;
+    FcFont font;
+    FcPattern *base_pattern = get_base_pattern(name, lua_isnumber(L, 2), lua_tonumber(L, 2), &error);
+    if (!base_pattern || (error = fcfont_load(&font, base_pattern, 0)) != NULL)
+        return luaL_error(L, "%s: %s", name, error);
+    *(FcFont *)lua_newuserdata(L, sizeof(FcFont)) = font;
+    luaL_setmetatable(L, LFC_TYPE_FCFONT);
+    return 1;
+}
+
+#define LFC_REPLACEMENT_CHAR 0xFFFD
+
+// decodes one codepoint from [p, end), which must not be empty.
+// invalid or truncated sequences decode to U+FFFD and consume their maximal valid prefix (at least 1 byte).
+static inline const char *utf8_decode(const char *p, const char *end, unsigned *dst)
+{
+    const unsigned char *up = (const unsigned char *)p;
+    const size_t avail = end - p;
+    unsigned res, n, lo = 0x80, hi = 0xbf;
+    if (up[0] < 0x80)
+    {
+        *dst = up[0];
+        return p + 1;
+    }
+    else if (up[0] >= 0xc2 && up[0] <= 0xdf)
+    {
+        res = up[0] & 0x1f;
+        n = 1;
+    }
+    else if (up[0] >= 0xe0 && up[0] <= 0xef)
+    {
+        // reject overlong forms and surrogates
+        if (up[0] == 0xe0)
+            lo = 0xa0;
+        else if (up[0] == 0xed)
+            hi = 0x9f;
+        res = up[0] & 0x0f;
+        n = 2;
+    }
+    else if (up[0] >= 0xf0 && up[0] <= 0xf4)
+    {
+        // reject overlong forms and codepoints above U+10FFFF
+        if (up[0] == 0xf0)
+            lo = 0x90;
+        else if (up[0] == 0xf4)
+            hi = 0x8f;
+        res = up[0] & 0x07;
+        n = 3;
+    }
+    else
+    {
+        *dst = LFC_REPLACEMENT_CHAR;
+        return p + 1;
+    }
+    for (unsigned i = 1; i <= n; i++, lo = 0x80, hi = 0xbf)
+    {
+        if (i >= avail || up[i] < lo || up[i] > hi)
+        {
+            *dst = LFC_REPLACEMENT_CHAR;
+            return p + i;
+        }
+        res = (res << 6) | (up[i] & 0x3f);
+    }
+    *dst = res;
+    return p + n + 1;
+}
+
+// returns a pointer to the first non-ASCII byte in [p, end)
+static inline const char *ascii_prefix(const char *p, const char *end)
+{
+#if defined(__AVX2__)
+    for (; end - p >= 32; p += 32)
+    {
+        unsigned mask = _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)p));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+    for (; end - p >= 16; p += 16)
+    {
+        unsigned mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)p));
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+#else
+    for (; end - p >= 8; p += 8)
+    {
+        unsigned long long word;
+        memcpy(&word, p, sizeof(word));
+        if (word & 0x8080808080808080ull)
+            break;
+    }
+#endif
+    while (p < end && !(*p & 0x80))
+        p++;
+    return p;
+}
+
+// skips ASCII text like ascii_prefix(), counting the tabs and the other blanks
+// (spaces, control characters and DEL) in it
+static inline const char *ascii_classes(const char *p, const char *end, size_t *tabs, size_t *blanks)
+{
+    size_t ntabs = 0, nblanks = 0;
+#if defined(__AVX2__)
+    const __m256i tab32 = _mm256_set1_epi8('\t'), graph32 = _mm256_set1_epi8(0x21), del32 = _mm256_set1_epi8(0x7f);
+    for (; end - p >= 32; p += 32)
+    {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)p);
+        if (_mm256_movemask_epi8(chunk))
+            break;
+        __m256i blank = _mm256_or_si256(_mm256_cmpgt_epi8(graph32, chunk), _mm256_cmpeq_epi8(chunk, del32));
+        ntabs += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, tab32)));
+        nblanks += __builtin_popcount(_mm256_movemask_epi8(blank));
+    }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+    const __m128i tab16 = _mm_set1_epi8('\t'), graph16 = _mm_set1_epi8(0x21), del16 = _mm_set1_epi8(0x7f);
+    for (; end - p >= 16; p += 16)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        if (_mm_movemask_epi8(chunk))
+            break;
+        __m128i blank = _mm_or_si128(_mm_cmplt_epi8(chunk, graph16), _mm_cmpeq_epi8(chunk, del16));
+        ntabs += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, tab16)));
+        nblanks += __builtin_popcount(_mm_movemask_epi8(blank));
+    }
+#else
+    const unsigned long long low = 0x7f7f7f7f7f7f7f7full, high = 0x8080808080808080ull;
+    for (; end - p >= 8; p += 8)
+    {
+        unsigned long long word, tab, del;
+        memcpy(&word, p, sizeof(word));
+        if (word & high)
+            break;
+        // sets the high bit of the bytes equal to 0x09 and 0x7f, and of the bytes below 0x21
+        tab = ~(((word ^ 0x0909090909090909ull) + low) | word | low);
+        del = ~(((word ^ low) + low) | (word ^ low) | low);
+        ntabs += __builtin_popcountll(tab);
+        nblanks += __builtin_popcountll((~(word + 0x5f5f5f5f5f5f5f5full) & high) | del);
+    }
+#endif
+    for (; p < end && !(*p & 0x80); p++)
+    {
+        ntabs += *p == '\t';
+        nblanks += *p < 0x21 || *p == 0x7f;
+    }
+    *tabs += ntabs;
+    *blanks += nblanks - ntabs;
+    return p;
+}
+
+// checks if a font covers a codepoint, given the first font that covers it from the coverage table
+static inline int font_has_char(FcFont *fc, int font, unsigned codepoint, unsigned first)
+{
+    return first == (unsigned)font || (first < (unsigned)font && fcfont_has_char(fc, font, codepoint));
+}
+
+// spaces, digits, ASCII punctuation and combining marks are in almost every font, so they do
+// not decide the font of a run
+static inline int is_script_neutral(unsigned codepoint)
+{
+    return (codepoint >= 0x20 && codepoint < 0x41) || (codepoint >= 0x5B && codepoint < 0x61) ||
+           (codepoint >= 0x7B && codepoint < 0x7F) || codepoint == 0xA0 ||
+           (codepoint >= 0x300 && codepoint < 0x370) || (codepoint >= 0x1AB0 && codepoint < 0x1B00) ||
+           (codepoint >= 0x1DC0 && codepoint < 0x1E00) || (codepoint >= 0x20D0 && codepoint < 0x2100) ||
+           (codepoint >= 0xFE20 && codepoint < 0xFE30);
+}
+
+#define LFC_NEUTRAL_LOOKAHEAD 64
+
+// picks the font for script-neutral characters at the start of a segment: the font of the
+// character after them, if it has all of them, so that they do not end up in a segment of
+// their own. Returns -1 to use the regular lookup.
+static int neutral_run_font(FcFont *fc, const char *p, const char *end, int current_font)
+{
+    const char *start = p;
+    unsigned codepoint, first;
+    int font, n = 0;
+    // the primary font keeps neutral ASCII followed by more ASCII, like indentation
+    if (current_font == 0 && fc->ascii_primary)
+    {
+        while (p < end && *p >= 0x20 && *p < 0x41)
+            p++;
+        if (p < end && !(*p & 0x80))
+            return 0;
+        p = start;
+    }
+    do
+    {
+        if (++n > LFC_NEUTRAL_LOOKAHEAD)
+            return -1;
+        p = utf8_decode(p, end, &codepoint);
+    } while (p < end && is_script_neutral(codepoint));
+    if (is_script_neutral(codepoint) || (first = fcfont_lookup(fc, codepoint)) == LFC_COVERAGE_NONE)
+        return -1;
+    font = font_has_char(fc, current_font, codepoint, first) ? current_font : (int)first;
+    for (p = start; p < end; )
+    {
+        const char *next = utf8_decode(p, end, &codepoint);
+        if (!is_script_neutral(codepoint))
+            break;
+        first = fcfont_lookup(fc, codepoint);
+        if (first != LFC_COVERAGE_NONE && !font_has_char(fc, font, codepoint, first))
+            return -1;
+        p = next;
+    }
+    return font;
+}
+
+// whether there is no extended grapheme cluster boundary before a character (UAX #29).
+// prev is the break property of the previous character, ri the number of regional indicators
+// before it, and emoji is 2 after an extended pictographic character, extenders and a ZWJ.
+static inline int grapheme_joins(unsigned prev, unsigned props, int ri, int emoji)
+{
+    unsigned gcb = props & LFC_GCB_MASK;
+    if (prev == LFC_GCB_CR && gcb == LFC_GCB_LF)
+        return 1;
+    if (prev == LFC_GCB_CR || prev == LFC_GCB_LF || prev == LFC_GCB_CONTROL ||
+        gcb == LFC_GCB_CR || gcb == LFC_GCB_LF || gcb == LFC_GCB_CONTROL)
+        return 0;
+    if (gcb == LFC_GCB_EXTEND || gcb == LFC_GCB_ZWJ || gcb == LFC_GCB_SPACINGMARK || prev == LFC_GCB_PREPEND)
+        return 1;
+    switch (prev)
+    {
+    case LFC_GCB_L:
+        return gcb == LFC_GCB_L || gcb == LFC_GCB_V || gcb == LFC_GCB_LV || gcb == LFC_GCB_LVT;
+    case LFC_GCB_LV:
+    case LFC_GCB_V:
+        return gcb == LFC_GCB_V || gcb == LFC_GCB_T;
+    case LFC_GCB_LVT:
+    case LFC_GCB_T:
+        return gcb == LFC_GCB_T;
+    case LFC_GCB_RI:
+        return gcb == LFC_GCB_RI && ri % 2 == 1;
+    case LFC_GCB_ZWJ:
+        return emoji == 2 && (props & LFC_EXT_PICT);
+    }
+    return 0;
+}
+
+// returns the end of the extended grapheme cluster starting at p, and whether a font has all
+// of its characters. Characters that no font has are ignored.
+static const char *next_cluster(FcFont *fc, const char *p, const char *end, int font, int *fits)
+{
+    const char *start = p;
+    unsigned codepoint, first, props, gcb, prev = LFC_GCB_OTHER;
+    int ri = 0, emoji = 0;
+    *fits = 1;
+    // ASCII followed by ASCII is a cluster of its own, but for CR LF
+    if (!(*p & 0x80) && *p != '\r' && (p + 1 == end || !(p[1] & 0x80)))
+    {
+        first = fcfont_lookup(fc, (unsigned char)*p);
+        *fits = first == LFC_COVERAGE_NONE || font_has_char(fc, font, (unsigned char)*p, first);
+        return p + 1;
+    }
+    while (p < end)
+    {
+        const char *next = utf8_decode(p, end, &codepoint);
+        props = lfc_grapheme_props(codepoint);
+        gcb = props & LFC_GCB_MASK;
+        if (p > start && !grapheme_joins(prev, props, ri, emoji))
+            break;
+        first = fcfont_lookup(fc, codepoint);
+        if (first != LFC_COVERAGE_NONE && !font_has_char(fc, font, codepoint, first))
+            *fits = 0;
+        ri = gcb == LFC_GCB_RI ? ri + 1 : 0;
+        emoji = (props & LFC_EXT_PICT) ? 1 : emoji == 1 && gcb == LFC_GCB_EXTEND ? 1 : emoji == 1 && gcb == LFC_GCB_ZWJ ? 2 : 0;
+        prev = gcb;
+        p = next;
+    }
+    return p;
+}
+
+// picks the font of a cluster that the current font cannot draw whole: the first font of one
+// of its characters that has all of them, or else the first font of its first character
+static unsigned cluster_font(FcFont *fc, const char *p, const char *end)
+{
+    unsigned codepoint, first, font = LFC_COVERAGE_NONE;
+    int fits;
+    for (const char *q = p; q < end;)
+    {
+        q = utf8_decode(q, end, &codepoint);
+        if ((first = fcfont_lookup(fc, codepoint)) == LFC_COVERAGE_NONE || first == font)
+            continue;
+        if (next_cluster(fc, p, end, first, &fits) && fits)
+            return first;
+        if (font == LFC_COVERAGE_NONE)
+            font = first;
+    }
+    return font;
+}
+
+// With LFC_FALLBACK_FIRST a cluster that the current font cannot draw goes to the first font
+// that can, with LFC_FALLBACK_LONGEST to the font that can draw the most clusters from there on.
+#define LFC_FALLBACK_FIRST 0
+#define LFC_FALLBACK_LONGEST 1
+#define LFC_LONGEST_LOOKAHEAD 256
+
+// picks the font that draws the longest run of clusters from p, lower indices win ties.
+// Only fonts already in the coverage table that have the first character are considered.
+static unsigned longest_font(FcFont *fc, const char *p, const char *end)
+{
+    unsigned best = LFC_COVERAGE_NONE, codepoint, first;
+    int best_clusters = 0;
+    utf8_decode(p, end, &codepoint);
+    first = fcfont_lookup(fc, codepoint);
+    // fonts before the first one that has the character cannot draw a single cluster
+    for (int i = first == LFC_COVERAGE_NONE ? 0 : (int)first; i < fc->covered; i++)
+    {
+        const char *q = p;
+        int fits = 1, clusters = 0;
+        if ((first != LFC_COVERAGE_NONE && !font_has_char(fc, i, codepoint, first)) || !fcfont_loadable(fc, i))
+            continue;
+        while (q < end && clusters < LFC_LONGEST_LOOKAHEAD)
+        {
+            const char *next = next_cluster(fc, q, end, i, &fits);
+            if (!fits)
+                break;
+            q = next;
+            clusters++;
+        }
+        if (clusters > best_clusters)
+        {
+            best = i;
+            best_clusters = clusters;
+        }
+        // no later font can do better
+        if (q == end || clusters == LFC_LONGEST_LOOKAHEAD)
+            break;
+    }
+    return best;
+}
+
+// finds the end of the run starting at p that is rendered with a single font, made of whole grapheme clusters.
+// current_font holds the font of the previous run and is updated to the font of this run;
+// the run stays in the same font as long as it covers the text, or no font covers it at all.
+static const char *next_segment(FcFont *fc, const char *p, const char *end, int *current_font)
+{
+    unsigned codepoint, font;
+    int neutral, fits;
+    const char *next;
+    utf8_decode(p, end, &codepoint);
+    if (is_script_neutral(codepoint) && (neutral = neutral_run_font(fc, p, end, *current_font)) >= 0)
+        *current_font = neutral;
+    next = next_cluster(fc, p, end, *current_font, &fits);
+    if (!fits && fc->fallback_mode == LFC_FALLBACK_LONGEST && (font = longest_font(fc, p, end)) != LFC_COVERAGE_NONE)
+        *current_font = font;
+    else if (!fits && (font = cluster_font(fc, p, next)) != LFC_COVERAGE_NONE)
+        *current_font = font;
+    for (p = next; p < end; p = next)
+    {
+        if (*current_font == 0 && fc->ascii_primary)
+        {
+            const char *ascii = ascii_prefix(p, end);
+            if (ascii == end)
+                return end;
+            // the last ASCII character can start a cluster with the characters after it
+            if (ascii > p)
+                p = ascii - 1;
+        }
+        next = next_cluster(fc, p, end, *current_font, &fits);
+        if (!fits)
+            break;
+    }
+    return p;
+}
+
+static int get_function(lua_State *L, const char *table, const char *function)
+{
+    if (lua_getfield(L, LUA_REGISTRYINDEX, table) != LUA_TTABLE)
+    { // -> [nil]
+        lua_pop(L, 1);
+        return -1;
+    } // -> [table]
+    if (lua_getfield(L, -1, function) != LUA_TFUNCTION)
+    { // -> [table, nil]
+        lua_pop(L, 2);
+        return -1;
+    } // -> [table, function]
+    lua_remove(L, lua_gettop(L) - 1); // -> [function]
+    return 0;
+}
+
+// replaces a callback reference with the current value of table.function
+static void bind_callback(lua_State *L, int *ref, const char *table, const char *function)
+{
+    luaL_unref(L, LUA_REGISTRYINDEX, *ref);
+    *ref = LUA_NOREF;
+    if (get_function(L, table, function) == 0) // -> [function]
+        *ref = luaL_ref(L, LUA_REGISTRYINDEX); // -> []
+}
+
+static int get_callback(lua_State *L, int ref)
+{
+    if (lua_rawgeti(L, LUA_REGISTRYINDEX, ref) != LUA_TFUNCTION)
+    { // -> [nil]
+        lua_pop(L, 1);
+        return -1;
+    } // -> [function]
+    return 0;
+}
+
+static double get_time()
+{
+#ifdef _WIN32
+    return (double) GetTickCount() / 1000;
+#else
+    struct timespec spec;
+    clock_gettime(CLOCK_MONOTONIC, &spec);
+    return spec.tv_sec + spec.tv_nsec / 1.0e9;
+#endif
+}
+
+// render options of a cache entry, passed to renderer.font.load()
+#define LFC_AA_MASK 0x3
+#define LFC_AA_NONE 0x1
+#define LFC_AA_GRAYSCALE 0x2
+#define LFC_AA_SUBPIXEL 0x3
+#define LFC_HINT_MASK 0xc
+#define LFC_HINT_NONE 0x4
+#define LFC_HINT_SLIGHT 0x8
+#define LFC_HINT_FULL 0xc
+#define LFC_BOLD 0x10
+
+static int get_render_options(FcPattern *pattern)
+{
+    int options = 0, value;
+    FcBool enabled;
+    if (FcPatternGetBool(pattern, FC_ANTIALIAS, 0, &enabled) == FcResultMatch && !enabled)
+        options |= LFC_AA_NONE;
+    else if (FcPatternGetInteger(pattern, FC_RGBA, 0, &value) == FcResultMatch && value != FC_RGBA_UNKNOWN)
+        options |= value == FC_RGBA_NONE ? LFC_AA_GRAYSCALE : LFC_AA_SUBPIXEL;
+    if (FcPatternGetBool(pattern, FC_HINTING, 0, &enabled) == FcResultMatch && !enabled)
+        options |= LFC_HINT_NONE;
+    else if (FcPatternGetInteger(pattern, FC_HINT_STYLE, 0, &value) == FcResultMatch)
+        options |= value == FC_HINT_NONE ? LFC_HINT_NONE : value == FC_HINT_SLIGHT ? LFC_HINT_SLIGHT : LFC_HINT_FULL;
+    if (FcPatternGetBool(pattern, FC_EMBOLDEN, 0, &enabled) == FcResultMatch && enabled)
+        options |= LFC_BOLD;
+    return options;
+}
+
+static void push_render_options(lua_State *L, int options)
+{
+    static const char *const antialiasing[] = {NULL, "none", "grayscale", "subpixel"};
+    static const char *const hinting[] = {NULL, "none", "slight", "full"};
+    lua_createtable(L, 0, 3);
+    if (antialiasing[options & LFC_AA_MASK])
+    {
+        lua_pushstring(L, antialiasing[options & LFC_AA_MASK]);
+        lua_setfield(L, -2, "antialiasing");
+    }
+    if (hinting[(options & LFC_HINT_MASK) >> 2])
+    {
+        lua_pushstring(L, hinting[(options & LFC_HINT_MASK) >> 2]);
+        lua_setfield(L, -2, "hinting");
+    }
+    if (options & LFC_BOLD)
+    {
+        lua_pushboolean(L, 1);
+        lua_setfield(L, -2, "bold");
+    }
+}
+
+// a renderer font loaded for a (file, face index, pixel size, render options) key
+#define LFC_ADVANCE_PAGES (0x100000 >> 8)
+#define LFC_ADVANCE_MISSING -1e30f // advances can be negative
+
+typedef struct LFCFace
+{
+    FT_Face face;
+    int load_flags;
+    int deltas; // whether the renderer includes the hinting deltas in advances
+    float space_advance, tab_advance;
+    float cell_advance;  // advance of every printable ASCII character but the space, 0 if they differ
+    float blank_advance; // advance of the space, control characters and DEL
+    float **pages; // advances indexed by codepoint >> 8, LFC_ADVANCE_MISSING if there is no glyph
+} LFCFace;
+
+static void face_free(LFCFace *face);
+
+typedef struct LFCCacheEntry
+{
+    char *file;
+    int index, options;
+    double size;
+    unsigned hash;
+    int ref;  // registry reference to the renderer font
+    int pins; // number of FcFonts using this as their primary font, pinned entries are never evicted
+    size_t bytes;
+    double last_used;
+    double space_width;   // width of a space, 0 until measured
+    int face_state;       // LFC_FACE_*
+    LFCFace *face;        // native advances, see face_text_width()
+    struct LFCCacheEntry *next;
+    struct LFCCacheEntry *newer, *older; // LRU list
+} LFCCacheEntry;
+
+typedef struct LFCCache
+{
+    LFCCacheEntry **buckets;
+    size_t nbuckets, count, bytes;
+    size_t max_entries, max_bytes;
+    LFCCacheEntry *newest, *oldest;
+    unsigned generation; // incremented when entries are removed, invalidates FcFont.entries
+} LFCCache;
+
+static LFCCache font_cache = {.max_entries = 64, .max_bytes = 256 * 1024 * 1024};
+
+static unsigned font_cache_hash(const char *file, int index, double size, int options)
+{
+    unsigned long long bits;
+    unsigned hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char *)file; *p; p++)
+        hash = (hash ^ *p) * 16777619u;
+    memcpy(&bits, &size, sizeof(bits));
+    hash = (hash ^ (unsigned)index) * 16777619u;
+    hash = (hash ^ (unsigned)bits) * 16777619u;
+    hash = (hash ^ (unsigned)(bits >> 32)) * 16777619u;
+    hash = (hash ^ (unsigned)options) * 16777619u;
+    return hash;
+}
+
+static int font_cache_grow(void)
+{
+    size_t nbuckets = font_cache.nbuckets ? font_cache.nbuckets * 2 : 64;
+    LFCCacheEntry **buckets = calloc(nbuckets, sizeof(LFCCacheEntry *));
+    if (!buckets)
+        return -1;
+    for (size_t i = 0; i < font_cache.nbuckets; i++)
+    {
+        LFCCacheEntry *entry = font_cache.buckets[i], *next;
+        for (; entry; entry = next)
+        {
+            next = entry->next;
+            entry->next = buckets[entry->hash & (nbuckets - 1)];
+            buckets[entry->hash & (nbuckets - 1)] = entry;
+        }
+    }
+    free(font_cache.buckets);
+    font_cache.buckets = buckets;
+    font_cache.nbuckets = nbuckets;
+    return 0;
+}
+
+static void font_cache_unlink(LFCCacheEntry *entry)
+{
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        font_cache.newest = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        font_cache.oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+// marks an entry as the most recently used one
+static void font_cache_touch(LFCCacheEntry *entry)
+{
+    entry->last_used = get_time();
+    if (font_cache.newest == entry)
+        return;
+    if (entry->newer || entry->older || font_cache.oldest == entry)
+        font_cache_unlink(entry);
+    entry->older = font_cache.newest;
+    if (font_cache.newest)
+        font_cache.newest->newer = entry;
+    font_cache.newest = entry;
+    if (!font_cache.oldest)
+        font_cache.oldest = entry;
+}
+
+// fonts are loaded from disk by the renderer, so the file size is used as an estimate of its memory usage
+static size_t get_file_size(const char *file)
+{
+    struct stat st;
+    return stat(file, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+static void draw_queue_flush(lua_State *L);
+
+// unlinks an entry from the cache and releases the renderer font
+static void font_cache_remove(lua_State *L, LFCCacheEntry *entry)
+{
+    LFCCacheEntry **pp;
+    // queued text refers to its renderer font by entry
+    draw_queue_flush(L);
+    pp = &font_cache.buckets[entry->hash & (font_cache.nbuckets - 1)];
+    while (*pp != entry)
+        pp = &(*pp)->next;
+    *pp = entry->next;
+    font_cache_unlink(entry);
+    luaL_unref(L, LUA_REGISTRYINDEX, entry->ref);
+    font_cache.count--;
+    font_cache.bytes -= entry->bytes;
+    font_cache.generation++;
+    face_free(entry->face);
+    free(entry->file);
+    free(entry);
+}
+
+// evicts the least recently used unpinned entries until there is room for an entry of the given size
+static void font_cache_evict(lua_State *L, size_t count, size_t bytes)
+{
+    LFCCacheEntry *entry = font_cache.oldest, *newer;
+    for (; entry && (font_cache.count + count > font_cache.max_entries ||
+                     font_cache.bytes + bytes > font_cache.max_bytes);
+         entry = newer)
+    {
+        newer = entry->newer;
+        if (entry->pins == 0)
+            font_cache_remove(L, entry);
+    }
+}
+
+// finds or loads the renderer font for a pattern
+static LFCCacheEntry *font_cache_get(lua_State *L, FcPattern *pattern)
+{
+    const char *file;
+    int index = 0, options;
+    double size;
+    unsigned hash;
+    size_t bytes;
+    LFCCacheEntry *entry;
+
+    if (FcPatternGetString(pattern, FC_FILE, 0, (FcChar8 **)&file) != FcResultMatch)
+        return NULL;
+    if (FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &size) != FcResultMatch)
+        return NULL;
+    FcPatternGetInteger(pattern, FC_INDEX, 0, &index);
+    options = get_render_options(pattern);
+
+    hash = font_cache_hash(file, index, size, options);
+    if (font_cache.nbuckets)
+    {
+        for (entry = font_cache.buckets[hash & (font_cache.nbuckets - 1)]; entry; entry = entry->next)
+        {
+            if (entry->hash == hash && entry->index == index && entry->size == size &&
+                entry->options == options && strcmp(entry->file, file) == 0)
+                return entry;
+        }
+    }
+
+    if (font_cache.count >= font_cache.nbuckets && font_cache_grow() != 0)
+        return NULL;
+    bytes = get_file_size(file);
+    font_cache_evict(L, 1, bytes);
+    if (get_callback(L, callbacks.load) != 0)
+        luaL_error(L, "cannot get font.load()");
+    // -> [font.load]
+    lua_pushstring(L, file);                // -> [font.load, filename]
+    lua_pushnumber(L, size);                // -> [font.load, filename, size]
+    push_render_options(L, options);        // -> [font.load, filename, size, options]
+    if (lua_pcall(L, 3, 1, 0) != LUA_OK)
+    { // -> [error]
+        lua_pop(L, 1);
+        return NULL;
+    } // -> [font]
+    entry = calloc(1, sizeof(LFCCacheEntry));
+    if (!entry || !(entry->file = strdup(file)))
+    {
+        free(entry);
+        lua_pop(L, 1);
+        return NULL;
+    }
+    entry->index = index;
+    entry->size = size;
+    entry->options = options;
+    entry->hash = hash;
+    entry->bytes = bytes;
+    entry->ref = luaL_ref(L, LUA_REGISTRYINDEX); // -> []
+    entry->next = font_cache.buckets[hash & (font_cache.nbuckets - 1)];
+    font_cache.buckets[hash & (font_cache.nbuckets - 1)] = entry;
+    font_cache.count++;
+    font_cache.bytes += bytes;
+    return entry;
+}
+
+// forgets the renderer fonts of a chain, the pinned primary font survives unless unpin is set
+static void clear_font_entries(FcFont *font, int unpin)
+{
+    LFCCacheEntry *primary = font->entries[0];
+    if (primary && unpin)
+    {
+        primary->pins--;
+        primary = NULL;
+    }
+    memset(font->entries, 0, sizeof(LFCCacheEntry *) * font->n);
+    font->entries[0] = primary;
+    font->entries_generation = font_cache.generation;
+}
+
+// pushes the renderer font of the i-th font in the chain
+static LFCCacheEntry *get_font_entry(lua_State *L, FcFont *font, int i)
+{
+    LFCCacheEntry *entry;
+    if (font->entries_generation != font_cache.generation)
+        clear_font_entries(font, 0);
+    if (!(entry = font->entries[i]))
+    {
+        FcPattern *pattern = fcfont_pattern(font, i);
+        if (!pattern || !(entry = font_cache_get(L, pattern)))
+            return NULL;
+        font->entries[i] = entry;
+        if (i == 0)
+            entry->pins++;
+    }
+    font_cache_touch(entry);
+    return entry;
+}
+
+static int get_font_cache(lua_State *L, FcFont *font, int i)
+{
+    LFCCacheEntry *entry = get_font_entry(L, font, i);
+    if (!entry)
+        return -1;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, entry->ref); // -> [font]
+    return 0;
+}
+
+// The native width engine measures text with FreeType instead of calling renderer.font.get_width.
+// It mirrors how the renderer lays out glyphs, and every face is checked against the renderer
+// on a probe string before it is used, falling back to the renderer if they disagree.
+#define LFC_FACE_UNCHECKED 0
+#define LFC_FACE_NATIVE 1
+#define LFC_FACE_RENDERER 2
+
+#define LFC_WIDTH_NATIVE 0
+#define LFC_WIDTH_RENDERER 1
+
+static FT_Library ft_library;
+static int ft_state; // 0 if not initialized, 1 if available, -1 if not available
+
+static int ft_init(void)
+{
+    if (ft_state == 0)
+    {
+#ifdef FONTCONFIG_DYNAMIC
+        if (load_freetype() != NULL)
+        {
+            ft_state = -1;
+            return 0;
+        }
+#endif
+        ft_state = FT_Init_FreeType(&ft_library) == 0 ? 1 : -1;
+    }
+    return ft_state == 1;
+}
+
+static void face_free(LFCFace *face)
+{
+    if (!face)
+        return;
+    if (face->pages)
+    {
+        for (int i = 0; i < LFC_ADVANCE_PAGES; i++)
+            free(face->pages[i]);
+        free(face->pages);
+    }
+    if (face->face)
+        FT_Done_Face(face->face);
+    free(face);
+}
+
+// same load flags as the renderer, which uses the light target for slight hinting
+static int face_load_flags(int options)
+{
+    int target, hinting;
+    if ((options & LFC_AA_MASK) == LFC_AA_NONE)
+        target = FT_LOAD_TARGET_MONO;
+    else
+        target = (options & LFC_HINT_MASK) == LFC_HINT_FULL ? FT_LOAD_TARGET_NORMAL : FT_LOAD_TARGET_LIGHT;
+    hinting = (options & LFC_HINT_MASK) == LFC_HINT_NONE ? FT_LOAD_NO_HINTING : FT_LOAD_FORCE_AUTOHINT;
+    return target | hinting;
+}
+
+static float face_glyph_advance(LFCFace *face, unsigned codepoint, int deltas)
+{
+    FT_UInt glyph = FT_Get_Char_Index(face->face, codepoint);
+    if (!glyph || FT_Load_Glyph(face->face, glyph, face->load_flags) != 0)
+        return LFC_ADVANCE_MISSING;
+    FT_GlyphSlot slot = face->face->glyph;
+    if (deltas)
+        return (slot->advance.x + slot->lsb_delta - slot->rsb_delta) / 64.0f;
+    return slot->advance.x / 64.0f;
+}
+
+static float face_advance(LFCFace *face, unsigned codepoint)
+{
+    float **page = &face->pages[codepoint >> 8];
+    if (!*page)
+    {
+        if (!(*page = malloc(sizeof(float) * 256)))
+            return LFC_ADVANCE_MISSING;
+        for (unsigned i = 0; i < 256; i++)
+            (*page)[i] = face_glyph_advance(face, (codepoint & ~0xFFu) | i, face->deltas);
+    }
+    return (*page)[codepoint & 0xFF];
+}
+
+// advance of a codepoint as the renderer computes it: missing glyphs outside Latin-1 are drawn
+// as U+25A1, and zero advances are replaced by the advance of the space.
+static float face_char_advance(LFCFace *face, unsigned codepoint, int deltas, int cached)
+{
+    float advance;
+    if (codepoint == '\t')
+        return face->tab_advance;
+    advance = cached ? face_advance(face, codepoint) : face_glyph_advance(face, codepoint, deltas);
+    if (advance == LFC_ADVANCE_MISSING && codepoint > 0xFF && codepoint != 0x25A1)
+        advance = cached ? face_advance(face, 0x25A1) : face_glyph_advance(face, 0x25A1, deltas);
+    return advance != LFC_ADVANCE_MISSING && advance != 0 ? advance : face->space_advance;
+}
+
+static size_t utf8_encode(char *dst, unsigned codepoint)
+{
+    if (codepoint < 0x80)
+    {
+        dst[0] = codepoint;
+        return 1;
+    }
+    if (codepoint < 0x800)
+    {
+        dst[0] = 0xC0 | (codepoint >> 6);
+        dst[1] = 0x80 | (codepoint & 0x3F);
+        return 2;
+    }
+    if (codepoint < 0x10000)
+    {
+        dst[0] = 0xE0 | (codepoint >> 12);
+        dst[1] = 0x80 | ((codepoint >> 6) & 0x3F);
+        dst[2] = 0x80 | (codepoint & 0x3F);
+        return 3;
+    }
+    dst[0] = 0xF0 | (codepoint >> 18);
+    dst[1] = 0x80 | ((codepoint >> 12) & 0x3F);
+    dst[2] = 0x80 | ((codepoint >> 6) & 0x3F);
+    dst[3] = 0x80 | (codepoint & 0x3F);
+    return 4;
+}
+
+// lets face_measure() count ASCII characters when every printable one has the same advance
+// and every blank other than the tab has the advance of the space
+static void face_init_cells(LFCFace *face)
+{
+    face->cell_advance = face_char_advance(face, '!', face->deltas, 1);
+    face->blank_advance = face_char_advance(face, ' ', face->deltas, 1);
+    for (unsigned c = 0; c < 0x80 && face->cell_advance; c++)
+    {
+        float advance = c < 0x21 || c == 0x7f ? face->blank_advance : face->cell_advance;
+        if (c != '\t' && face_char_advance(face, c, face->deltas, 1) != advance)
+            face->cell_advance = 0;
+    }
+}
+
+static double renderer_width(lua_State *L, LFCCacheEntry *entry, const char *str, size_t len)
+{
+    if (get_callback(L, callbacks.get_width) != 0)
+        return luaL_error(L, "cannot get font.get_width()");
+    // -> [get_width]
+    lua_rawgeti(L, LUA_REGISTRYINDEX, entry->ref); // -> [get_width, font]
+    lua_pushlstring(L, str, len);                  // -> [get_width, font, string]
+    lua_call(L, 2, 1);                             // -> [width]
+    double width = lua_tonumber(L, -1);
+    lua_pop(L, 1); // -> []
+    return width;
+}
+
+// opens the face of a renderer font and compares it with the renderer on a probe string
+static LFCFace *face_check(lua_State *L, LFCCacheEntry *entry)
+{
+    char probe[0x5F + 32 * 4];
+    unsigned codepoints[0x5F + 32];
+    size_t len = 0;
+    int n = 0;
+    FT_UInt glyph;
+    LFCFace *face;
+
+    if (!ft_init() || !(face = calloc(1, sizeof(LFCFace))))
+        return NULL;
+    // the renderer always loads the first face of a file
+    if (FT_New_Face(ft_library, entry->file, 0, &face->face) != 0)
+    {
+        face->face = NULL;
+        goto fail;
+    }
+    if (FT_Set_Pixel_Sizes(face->face, 0, (int)entry->size) != 0 || !(face->pages = calloc(sizeof(float *), LFC_ADVANCE_PAGES)))
+        goto fail;
+    face->load_flags = face_load_flags(entry->options);
+
+    // printable ASCII, followed by the first non-ASCII characters of the face
+    for (unsigned c = 0x20; c < 0x7F; c++)
+        codepoints[n++] = c;
+    for (FT_ULong c = FT_Get_First_Char(face->face, &glyph); glyph && n < 0x5F + 32; c = FT_Get_Next_Char(face->face, c, &glyph))
+    {
+        if (c >= 0x80 && c < 0x100000 && (c < 0xD800 || c > 0xDFFF))
+            codepoints[n++] = c;
+    }
+    for (int i = 0; i < n; i++)
+        len += utf8_encode(probe + len, codepoints[i]);
+
+    face->tab_advance = renderer_width(L, entry, "\t", 1);
+    double expected = renderer_width(L, entry, probe, len);
+    for (face->deltas = 1; face->deltas >= 0; face->deltas--)
+    {
+        double width = 0;
+        float space = face_glyph_advance(face, ' ', face->deltas);
+        face->space_advance = space != LFC_ADVANCE_MISSING ? space : 0;
+        for (int i = 0; i < n; i++)
+            width += face_char_advance(face, codepoints[i], face->deltas, 0);
+        if (width - expected < 0.001 && expected - width < 0.001)
+        {
+            face_init_cells(face);
+            return face;
+        }
+    }
+fail:
+    face_free(face);
+    return NULL;
+}
+
+// whether a decoded codepoint is drawn as the renderer decodes it, malformed UTF-8 is not
+static inline int face_codepoint_valid(const char *p, const char *next, unsigned codepoint)
+{
+    return codepoint < 0x100000 &&
+           (codepoint != LFC_REPLACEMENT_CHAR || (next - p == 3 && memcmp(p, "\xEF\xBF\xBD", 3) == 0));
+}
+
+// measures a single-font segment natively, fails if the face disagrees with the renderer
+// or if the text is not valid UTF-8, which the renderer decodes differently.
+// ASCII text in monospaced fonts is measured by counting characters, blanks and tabs.
+static int face_measure(LFCFace *face, const char *str, size_t len, int monospace, double *width)
+{
+    const char *p = str, *end = str + len;
+    unsigned codepoint;
+    monospace = monospace && face->cell_advance;
+    *width = 0;
+    while (p < end)
+    {
+        if (monospace)
+        {
+            size_t tabs = 0, blanks = 0;
+            const char *ascii_end = ascii_classes(p, end, &tabs, &blanks);
+            *width += (double)(ascii_end - p - tabs - blanks) * face->cell_advance +
+                      (double)blanks * face->blank_advance + (double)tabs * face->tab_advance;
+            if ((p = ascii_end) == end)
+                break;
+        }
+        const char *next = utf8_decode(p, end, &codepoint);
+        if (!face_codepoint_valid(p, next, codepoint))
+            return -1;
+        *width += face_char_advance(face, codepoint, face->deltas, 1);
+        p = next;
+    }
+    return 0;
+}
+
+static int face_text_width(lua_State *L, LFCCacheEntry *entry, const char *str, size_t len, int monospace, double *width)
+{
+    if (entry->face_state == LFC_FACE_UNCHECKED)
+    {
+        entry->face = face_check(L, entry);
+        entry->face_state = entry->face ? LFC_FACE_NATIVE : LFC_FACE_RENDERER;
+    }
+    if (entry->face_state != LFC_FACE_NATIVE)
+        return -1;
+    return face_measure(entry->face, str, len, monospace, width);
+}
+
+// Optional cache of get_width() results, for strings that are measured over and over.
+typedef struct LFCWidthEntry
+{
+    unsigned long long hash;
+    size_t len;
+    double tab_offset, width;
+    struct LFCWidthEntry *next;
+    struct LFCWidthEntry *newer, *older; // LRU list
+    char text[];
+} LFCWidthEntry;
+
+typedef struct LFCWidthCache
+{
+    LFCWidthEntry **buckets;
+    size_t nbuckets, count, capacity;
+    LFCWidthEntry *newest, *oldest;
+    size_t hits, misses;
+    unsigned generation; // generation of the font the widths were measured with
+} LFCWidthCache;
+
+static unsigned long long text_hash(const char *text, size_t len)
+{
+    unsigned long long hash = len * 0x9e3779b97f4a7c15ull, word;
+    for (; len >= 8; text += 8, len -= 8)
+    {
+        memcpy(&word, text, sizeof(word));
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    word = 0;
+    memcpy(&word, text, len);
+    hash = (hash ^ word) * 0xc4ceb9fe1a85ec53ull;
+    return hash ^ (hash >> 29);
+}
+
+static void width_cache_clear(LFCWidthCache *cache)
+{
+    for (LFCWidthEntry *entry = cache->newest, *older; entry; entry = older)
+    {
+        older = entry->older;
+        free(entry);
+    }
+    memset(cache->buckets, 0, sizeof(LFCWidthEntry *) * cache->nbuckets);
+    cache->count = 0;
+    cache->newest = cache->oldest = NULL;
+}
+
+static void width_cache_free(LFCWidthCache *cache)
+{
+    if (!cache)
+        return;
+    width_cache_clear(cache);
+    free(cache->buckets);
+    free(cache);
+}
+
+static void width_cache_unlink(LFCWidthCache *cache, LFCWidthEntry *entry)
+{
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        cache->newest = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+static void width_cache_push(LFCWidthCache *cache, LFCWidthEntry *entry)
+{
+    entry->older = cache->newest;
+    if (cache->newest)
+        cache->newest->newer = entry;
+    cache->newest = entry;
+    if (!cache->oldest)
+        cache->oldest = entry;
+}
+
+static void width_cache_remove(LFCWidthCache *cache, LFCWidthEntry *entry)
+{
+    LFCWidthEntry **pp = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    while (*pp != entry)
+        pp = &(*pp)->next;
+    *pp = entry->next;
+    width_cache_unlink(cache, entry);
+    cache->count--;
+    free(entry);
+}
+
+// sets the capacity of the cache of a font, 0 disables it
+static int width_cache_resize(FcFont *font, size_t capacity)
+{
+    LFCWidthCache *cache = font->width_cache;
+    size_t nbuckets = 16;
+    if (capacity == 0)
+    {
+        width_cache_free(cache);
+        font->width_cache = NULL;
+        return 0;
+    }
+    if (!cache && !(cache = font->width_cache = calloc(1, sizeof(LFCWidthCache))))
+        return -1;
+    while (nbuckets < capacity)
+        nbuckets *= 2;
+    if (nbuckets != cache->nbuckets)
+    {
+        LFCWidthEntry **buckets = calloc(sizeof(LFCWidthEntry *), nbuckets);
+        if (!buckets)
+            return -1;
+        width_cache_clear(cache);
+        free(cache->buckets);
+        cache->buckets = buckets;
+        cache->nbuckets = nbuckets;
+    }
+    cache->capacity = capacity;
+    while (cache->count > capacity)
+        width_cache_remove(cache, cache->oldest);
+    return 0;
+}
+
+static LFCWidthEntry *width_cache_get(FcFont *font, unsigned long long hash, const char *text, size_t len, double tab_offset)
+{
+    LFCWidthCache *cache = font->width_cache;
+    if (cache->generation != font->generation)
+    {
+        width_cache_clear(cache);
+        cache->generation = font->generation;
+    }
+    for (LFCWidthEntry *entry = cache->buckets[hash & (cache->nbuckets - 1)]; entry; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->len == len && entry->tab_offset == tab_offset && memcmp(entry->text, text, len) == 0)
+        {
+            width_cache_unlink(cache, entry);
+            width_cache_push(cache, entry);
+            cache->hits++;
+            return entry;
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+static void width_cache_add(FcFont *font, unsigned long long hash, const char *text, size_t len, double tab_offset, double width)
+{
+    LFCWidthCache *cache = font->width_cache;
+    LFCWidthEntry *entry;
+    if (cache->generation != font->generation)
+        return;
+    if (cache->count >= cache->capacity)
+        width_cache_remove(cache, cache->oldest);
+    if (!(entry = malloc(sizeof(LFCWidthEntry) + len)))
+        return;
+    entry->hash = hash;
+    entry->len = len;
+    entry->tab_offset = tab_offset;
+    entry->width = width;
+    memcpy(entry->text, text, len);
+    entry->newer = entry->older = NULL;
+    entry->next = cache->buckets[hash & (cache->nbuckets - 1)];
+    cache->buckets[hash & (cache->nbuckets - 1)] = entry;
+    cache->count++;
+    width_cache_push(cache, entry);
+}
+
+// releases the fontconfig objects of a font and its hold on its primary renderer font
+static void fcfont_free(FcFont *font)
+{
+    if (font->entries && font->entries[0])
+        font->entries[0]->pins--;
+    for (int i = 0; i < font->n; i++)
+    {
+        if (font->patterns && font->patterns[i])
+            FcPatternDestroy(font->patterns[i]);
+        if (font->charsets && font->charsets[i])
+            FcCharSetDestroy(font->charsets[i]);
+        if (font->sources && font->sources[i])
+            FcPatternDestroy(font->sources[i]);
+    }
+    if (font->set)
+        FcFontSetDestroy(font->set);
+    chain_file_close(font->file);
+    free(font->sources);
+    if (font->base_pattern)
+        FcPatternDestroy(font->base_pattern);
+    free(font->patterns);
+    free(font->charsets);
+    free(font->entries);
+    free(font->uses);
+    free(font->loadable);
+    coverage_free(font->coverage);
+    width_cache_free(font->width_cache);
+    memset(font, 0, sizeof(FcFont));
+}
+
+static void fcfont_set_size(FcFont *font, double size)
+{
+    FcPatternDel(font->base_pattern, FC_PIXEL_SIZE);
+    FcPatternAddDouble(font->base_pattern, FC_PIXEL_SIZE, size);
+    for (int i = 0; i < font->n; i++)
+    {
+        if (!font->patterns[i])
+            continue;
+        FcPatternDel(font->patterns[i], FC_PIXEL_SIZE);
+        FcPatternAddDouble(font->patterns[i], FC_PIXEL_SIZE, size);
+    }
+    clear_font_entries(font, 1);
+    font->generation++;
+}
+
+#define LFC_JOB_PENDING 0
+#define LFC_JOB_PRIMARY 1
+#define LFC_JOB_DONE 2
+
+// state shared between an asynchronously loaded FcFont and its worker thread
+typedef struct LFCLoadJob
+{
+    LFCMutex mutex;
+    LFCCond cond;
+    int refs, state;
+    char *name;
+    int has_size;
+    double size;
+    const char *error;
+    FcFont primary, full; // chains waiting to be adopted by the FcFont
+} LFCLoadJob;
+
+static void job_release(LFCLoadJob *job)
+{
+    int refs;
+    lfc_mutex_lock(&job->mutex);
+    refs = --job->refs;
+    lfc_mutex_unlock(&job->mutex);
+    if (refs > 0)
+        return;
+    fcfont_free(&job->primary);
+    fcfont_free(&job->full);
+    lfc_cond_destroy(&job->cond);
+    lfc_mutex_destroy(&job->mutex);
+    free(job->name);
+    free(job);
+}
+
+static void job_publish(LFCLoadJob *job, FcFont *chain, const char *error)
+{
+    lfc_mutex_lock(&job->mutex);
+    if (error)
+    {
+        job->error = error;
+        job->state = LFC_JOB_DONE;
+    }
+    else if (job->state == LFC_JOB_PENDING)
+    {
+        job->primary = *chain;
+        job->state = LFC_JOB_PRIMARY;
+    }
+    else
+    {
+        job->full = *chain;
+        job->state = LFC_JOB_DONE;
+    }
+    lfc_cond_broadcast(&job->cond);
+    lfc_mutex_unlock(&job->mutex);
+}
+
+// resolves the primary font first so that the FcFont becomes usable early, then the whole chain
+static LFC_THREAD_FUNC(load_worker)
+{
+    LFCLoadJob *job = arg;
+    FcFont chain;
+    const char *error = NULL;
+    FcPattern *base_pattern = get_base_pattern(job->name, job->has_size, job->size, &error), *copy = NULL;
+    if (base_pattern && !(copy = FcPatternDuplicate(base_pattern)))
+        error = "cannot allocate memory";
+    if (copy)
+        error = fcfont_load(&chain, copy, 1);
+    job_publish(job, &chain, error);
+    if (error && base_pattern)
+        FcPatternDestroy(base_pattern);
+    else if (!error)
+        job_publish(job, &chain, fcfont_load(&chain, base_pattern, 0));
+    job_release(job);
+    LFC_THREAD_RETURN;
+}
+
+// replaces the chain of a font, keeping its settings
+static void fcfont_adopt(FcFont *font, FcFont *chain)
+{
+    double size;
+    int tab_size = font->tab_size, width_engine = font->width_engine, fallback_mode = font->fallback_mode, resize = 0;
+    unsigned generation = font->generation;
+    LFCLoadJob *job = font->job;
+    LFCWidthCache *width_cache = font->width_cache;
+    if (font->base_pattern)
+        resize = FcPatternGetDouble(font->base_pattern, FC_PIXEL_SIZE, 0, &size) == FcResultMatch;
+    font->width_cache = NULL;
+    fcfont_free(font);
+    *font = *chain;
+    memset(chain, 0, sizeof(FcFont));
+    font->tab_size = tab_size;
+    font->width_engine = width_engine;
+    font->fallback_mode = fallback_mode;
+    font->generation = generation + 1;
+    font->width_cache = width_cache;
+    font->job = job;
+    if (resize)
+        fcfont_set_size(font, size);
+}
+
+// picks up the chains resolved by the worker thread of an asynchronously loaded font.
+// with wait set, blocks until there is at least a primary font to use.
+static void fcfont_sync(FcFont *font, int wait)
+{
+    LFCLoadJob *job = font->job;
+    int done;
+    lfc_mutex_lock(&job->mutex);
+    while (wait && !font->patterns && job->state == LFC_JOB_PENDING)
+        lfc_cond_wait(&job->cond, &job->mutex);
+    if (job->full.patterns)
+        fcfont_adopt(font, &job->full);
+    else if (job->primary.patterns && !font->patterns)
+        fcfont_adopt(font, &job->primary);
+    done = job->state == LFC_JOB_DONE;
+    lfc_mutex_unlock(&job->mutex);
+    // the job is kept around after a failure so that using the font reports the error
+    if (done && font->patterns)
+    {
+        font->job = NULL;
+        job_release(job);
+    }
+}
+
+static FcFont *check_fcfont(lua_State *L, int idx)
+{
+    FcFont *font = luaL_checkudata(L, idx, LFC_TYPE_FCFONT);
+    if (font->job)
+        fcfont_sync(font, 1);
+    if (!font->patterns && font->job)
+        luaL_error(L, "%s: %s", font->job->name, font->job->error);
+    if (!font->patterns)
+        luaL_error(L, "attempt to use a closed font");
+    return font;
+}
+
+// counts the segments laid out with each font of the chain, so that to_group() knows which
+// fallbacks the text actually needs
+static inline void fcfont_use(FcFont *font, int i)
+{
+    if (!font->uses && !(font->uses = calloc(sizeof(unsigned), font->n)))
+        return;
+    if (font->uses[i]++ == 0)
+        font->group_dirty = 1;
+}
+
+static double get_width(lua_State *L, FcFont *font, int i, const char *str, size_t len)
+{
+    LFCCacheEntry *entry;
+    double width;
+    fcfont_use(font, i);
+    if (font->width_engine == LFC_WIDTH_NATIVE && (entry = get_font_entry(L, font, i)) &&
+        face_text_width(L, entry, str, len, i == 0 && font->monospace, &width) == 0)
+        return width;
+    if (get_callback(L, callbacks.get_width) != 0)
+    {
+        return luaL_error(L, "cannot get font.get_width()");
+    } // -> [get_width]
+    if (get_font_cache(L, font, i) != 0)
+    {
+        lua_pop(L, 1);
+        return 0;
+    } // -> [get_width, font]
+    lua_pushlstring(L, str, len); // -> [get_width, font, string]
+    lua_call(L, 2, 1);            // -> [width]
+    width = lua_tonumber(L, -1);
+    lua_pop(L, 1); // -> []
+    return width;
+}
+
+static double get_space_width(lua_State *L, FcFont *font)
+{
+    LFCCacheEntry *entry = get_font_entry(L, font, 0);
+    if (!entry)
+        return 0;
+    if (entry->space_width == 0 &&
+        (font->width_engine != LFC_WIDTH_NATIVE || face_text_width(L, entry, " ", 1, 0, &entry->space_width) != 0))
+        entry->space_width = renderer_width(L, entry, " ", 1);
+    return entry->space_width;
+}
+
+// splits text into single-font segments, once a tab size is set runs of spaces and tabs
+// become separate blank pieces that are laid out natively.
+static const char *next_piece(FcFont *fc, const char *p, const char *end, int *current_font, int *blank)
+{
+    const char *next, *tab;
+    *blank = fc->tab_size > 0 && (*p == ' ' || *p == '\t');
+    if (*blank)
+    {
+        while (p < end && (*p == ' ' || *p == '\t'))
+            p++;
+        return p;
+    }
+    next = next_segment(fc, p, end, current_font);
+    if (fc->tab_size > 0 && (tab = memchr(p, '\t', next - p)))
+        return tab;
+    return next;
+}
+
+// advances the pen over a blank piece, tabs move it to the next multiple of tab_size spaces
+// from the origin of the text.
+static double blank_advance_by(double space, int tab_size, const char *p, const char *end, double x)
+{
+    double tab = space * tab_size;
+    for (; p < end; p++)
+    {
+        if (*p == ' ')
+            x += space;
+        else if (tab > 0)
+            x = (floor((x + 1e-3) / tab) + 1) * tab;
+    }
+    return x;
+}
+
+static double blank_advance(lua_State *L, FcFont *fc, const char *p, const char *end, double x)
+{
+    return blank_advance_by(get_space_width(L, fc), fc->tab_size, p, end, x);
+}
+
+// lite-xl passes {tab_offset = x} with the pen position of the text relative to the tab origin
+static double get_tab_offset(lua_State *L, int idx)
+{
+    double offset = 0;
+    if (lua_istable(L, idx))
+    {
+        lua_getfield(L, idx, "tab_offset"); // -> [tab_offset]
+        offset = lua_tonumber(L, -1);
+        lua_pop(L, 1); // -> []
+    }
+    return offset;
+}
+
+static void count_segments(FcFont *fc, size_t segments)
+{
+    fc->texts++;
+    fc->segments += segments;
+    if (segments > fc->max_segments)
+        fc->max_segments = segments;
+}
+
+static double text_width(lua_State *L, FcFont *fc, const char *text, size_t len, double offset)
+{
+    const char *textp = text, *end = text + len;
+    unsigned long long hash = 0;
+    LFCWidthEntry *cached;
+
+    if (fc->width_cache)
+    {
+        hash = text_hash(text, len);
+        if ((cached = width_cache_get(fc, hash, text, len, offset)))
+            return cached->width;
+    }
+
+    int current_font = 0, blank;
+    size_t segments = 0;
+    double x = offset;
+    while (textp < end)
+    {
+        const char *segment = textp;
+        textp = next_piece(fc, textp, end, &current_font, &blank);
+        if (blank)
+            x = blank_advance(L, fc, segment, textp, x);
+        else
+        {
+            x += get_width(L, fc, current_font, segment, textp - segment);
+            segments++;
+        }
+    }
+    count_segments(fc, segments);
+    if (fc->width_cache)
+        width_cache_add(fc, hash, text, len, offset, x - offset);
+    return x - offset;
+}
+
+static int f_get_width(lua_State *L)
+{
+    size_t len = 0;
+    FcFont *fc = check_fcfont(L, 1);
+    const char *text = luaL_checklstring(L, 2, &len);
+    lua_pushnumber(L, text_width(L, fc, text, len, get_tab_offset(L, 3)));
+    return 1;
+}
+
+// measures an array of strings, or returns only the widest one with "max"
+static int f_get_widths(lua_State *L)
+{
+    static const char *const modes[] = {"all", "max", NULL};
+    FcFont *fc = check_fcfont(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int max_only = luaL_checkoption(L, 3, "all", modes);
+    lua_Integer n = luaL_len(L, 2), max_index = 0;
+    double max_width = 0;
+    lua_settop(L, 2);
+    if (!max_only)
+        lua_createtable(L, n, 0); // -> [widths]
+    for (lua_Integer i = 1; i <= n; i++)
+    {
+        size_t len;
+        lua_rawgeti(L, 2, i); // -> [widths?, text]
+        const char *text = lua_tolstring(L, -1, &len);
+        if (!text)
+            return luaL_error(L, "line %d is not a string", (int)i);
+        double width = text_width(L, fc, text, len, 0);
+        lua_pop(L, 1); // -> [widths?]
+        if (max_only)
+        {
+            if (width > max_width || max_index == 0)
+            {
+                max_width = width;
+                max_index = i;
+            }
+        }
+        else
+        {
+            lua_pushnumber(L, width); // -> [widths, width]
+            lua_rawseti(L, 3, i);     // -> [widths]
+        }
+    }
+    if (!max_only)
+        return 1;
+    lua_pushnumber(L, max_width);
+    if (max_index)
+        lua_pushinteger(L, max_index);
+    else
+        lua_pushnil(L);
+    return 2;
+}
+
+// Deferred drawing queues the segments drawn with system fonts, and merges a segment into the
+// previous one when it continues it with the same renderer font, color and y. The queue is
+// drawn by flush(), which has to run before anything else is drawn over the text.
+typedef struct LFCQueuedText
+{
+    LFCCacheEntry *entry;
+    double x, y, end_x;
+    double color[4];
+    size_t start, len; // bytes in LFCDrawQueue.text
+} LFCQueuedText;
+
+typedef struct LFCDrawQueue
+{
+    int enabled;
+    LFCQueuedText *items;
+    size_t count, size;
+    char *text;
+    size_t text_len, text_size;
+    size_t segments, calls, flushes; // statistics
+} LFCDrawQueue;
+
+static LFCDrawQueue draw_queue;
+
+static int draw_queue_reserve(size_t items, size_t bytes)
+{
+    if (draw_queue.count + items > draw_queue.size)
+    {
+        size_t size = draw_queue.size ? draw_queue.size * 2 : 256;
+        LFCQueuedText *queued = realloc(draw_queue.items, sizeof(LFCQueuedText) * size);
+        if (!queued)
+            return -1;
+        draw_queue.items = queued;
+        draw_queue.size = size;
+    }
+    if (draw_queue.text_len + bytes > draw_queue.text_size)
+    {
+        size_t size = draw_queue.text_size ? draw_queue.text_size : 4096;
+        while (size < draw_queue.text_len + bytes)
+            size *= 2;
+        char *text = realloc(draw_queue.text, size);
+        if (!text)
+            return -1;
+        draw_queue.text = text;
+        draw_queue.text_size = size;
+    }
+    return 0;
+}
+
+static void draw_queue_flush(lua_State *L)
+{
+    size_t count = draw_queue.count;
+    if (count == 0)
+        return;
+    // emptied first so that an error leaves the queue usable,
+    // the renderer never queues text so the items and text stay valid until the loop is done
+    draw_queue.count = 0;
+    draw_queue.text_len = 0;
+    draw_queue.flushes++;
+    draw_queue.calls += count;
+    if (get_callback(L, callbacks.draw_text) != 0)
+        luaL_error(L, "cannot get renderer.draw_text()"); // -> [draw_text]
+    lua_createtable(L, 4, 0); // -> [draw_text, color]
+    for (size_t i = 0; i < count; i++)
+    {
+        LFCQueuedText *queued = &draw_queue.items[i];
+        for (int c = 0; c < 4; c++)
+        {
+            lua_pushnumber(L, queued->color[c]); // -> [draw_text, color, value]
+            lua_rawseti(L, -2, c + 1);           // -> [draw_text, color]
+        }
+        lua_pushvalue(L, -2);                                            // -> [draw_text, color, draw_text]
+        lua_rawgeti(L, LUA_REGISTRYINDEX, queued->entry->ref);           // -> [draw_text, color, draw_text, font]
+        lua_pushlstring(L, draw_queue.text + queued->start, queued->len); // -> [..., font, text]
+        lua_pushnumber(L, queued->x);                                    // -> [..., font, text, x]
+        lua_pushnumber(L, queued->y);                                    // -> [..., font, text, x, y]
+        lua_pushvalue(L, -5);                                            // -> [..., font, text, x, y, color]
+        lua_call(L, 5, 0);                                               // -> [draw_text, color]
+    }
+    lua_pop(L, 2); // -> []
+}
+
+// queues a segment instead of drawing it, the end x is measured the way the renderer draws it
+static double draw_queue_text(lua_State *L, FcFont *font, int i, const char *str, size_t len, double x, double y, int color)
+{
+    LFCCacheEntry *entry;
+    LFCQueuedText *last;
+    double rgba[4];
+    double width = get_width(L, font, i, str, len);
+    if (!(entry = get_font_entry(L, font, i)))
+        return 0;
+    for (int c = 0; c < 4; c++)
+    {
+        lua_rawgeti(L, color, c + 1); // -> [value]
+        rgba[c] = luaL_optnumber(L, -1, 255);
+        lua_pop(L, 1); // -> []
+    }
+    if (draw_queue_reserve(1, len) != 0)
+        return luaL_error(L, "cannot allocate draw queue");
+    draw_queue.segments++;
+    last = draw_queue.count ? &draw_queue.items[draw_queue.count - 1] : NULL;
+    if (!last || last->entry != entry || last->y != y || last->end_x != x || memcmp(last->color, rgba, sizeof(rgba)) != 0)
+    {
+        last = &draw_queue.items[draw_queue.count++];
+        last->entry = entry;
+        last->x = x;
+        last->y = y;
+        memcpy(last->color, rgba, sizeof(rgba));
+        last->start = draw_queue.text_len;
+        last->len = 0;
+    }
+    memcpy(draw_queue.text + draw_queue.text_len, str, len);
+    draw_queue.text_len += len;
+    last->len += len;
+    last->end_x = x + width;
+    return last->end_x;
+}
+
+static double draw_text(lua_State *L, FcFont *font, int i, const char *str, size_t len, double x, double y, int color)
+{
+    if (draw_queue.enabled)
+        return draw_queue_text(L, font, i, str, len, x, y, color);
+    fcfont_use(font, i);
+    if (get_callback(L, callbacks.draw_text) != 0)
+    {
+        return luaL_error(L, "cannot get renderer.draw_text()");
+    } // -> [draw_text]
+    if (get_font_cache(L, font, i) != 0)
+    {
+        lua_pop(L, 1);
+        return 0;
+    } // -> [draw_text]
+    lua_pushlstring(L, str, len); // -> [draw_text, text]
+    lua_pushnumber(L, x);         // -> [draw_text, text, x]
+    lua_pushnumber(L, y);         // -> [draw_text, text, x, y]
+    lua_pushvalue(L, color);      // -> [draw_text, text, x, y, color]
+    lua_call(L, 5, 1);            // -> [new_x]
+    double new_x = lua_tonumber(L, -1);
+    lua_pop(L, 1); // -> []
+    return new_x;
+}
+
+// draws the part of a single-font segment of known width that overlaps [clip_left, clip_right).
+// With native advances the segment is cut to the codepoints crossing the edges, otherwise
+// it is drawn whole unless it lies entirely outside.
+static void draw_clipped(lua_State *L, FcFont *fc, int i, const char *str, size_t len, double x, double width,
+                         double y, int color, double clip_left, double clip_right)
+{
+    const char *p = str, *end = str + len, *start, *next;
+    LFCCacheEntry *entry;
+    double start_x = x;
+    unsigned codepoint;
+    float advance;
+
+    if (x + width <= clip_left || x >= clip_right)
+        return;
+    if ((x >= clip_left && x + width <= clip_right) || fc->width_engine != LFC_WIDTH_NATIVE ||
+        !(entry = get_font_entry(L, fc, i)) || entry->face_state != LFC_FACE_NATIVE)
+        goto whole;
+    for (; p < end; p = next, start_x += advance)
+    {
+        next = utf8_decode(p, end, &codepoint);
+        if (!face_codepoint_valid(p, next, codepoint))
+            goto whole;
+        advance = face_char_advance(entry->face, codepoint, entry->face->deltas, 1);
+        if (start_x + advance > clip_left)
+            break;
+    }
+    start = p;
+    for (double pen = start_x; p < end && pen < clip_right; p = next, pen += advance)
+    {
+        next = utf8_decode(p, end, &codepoint);
+        if (!face_codepoint_valid(p, next, codepoint))
+            goto whole;
+        advance = face_char_advance(entry->face, codepoint, entry->face->deltas, 1);
+    }
+    if (p > start)
+        draw_text(L, fc, i, start, p - start, start_x, y, color);
+    return;
+whole:
+    draw_text(L, fc, i, str, len, x, y, color);
+}
+
+// draws text with an FcFont, blank pieces are laid out from the tab origin.
+// With a clip range, segments outside of it are only measured.
+static double draw_pieces(lua_State *L, FcFont *fc, const char *text, size_t len, double x, double y, int color,
+                          double origin, double clip_left, double clip_right)
+{
+    const char *textp = text, *end = text + len;
+    int current_font = 0, blank, clip = clip_left > -HUGE_VAL || clip_right < HUGE_VAL;
+    size_t segments = 0;
+    while (textp < end)
+    {
+        const char *segment = textp;
+        textp = next_piece(fc, textp, end, &current_font, &blank);
+        segments += !blank;
+        if (blank)
+            x = origin + blank_advance(L, fc, segment, textp, x - origin);
+        else if (!clip)
+            x = draw_text(L, fc, current_font, segment, textp - segment, x, y, color);
+        else
+        {
+            double width = get_width(L, fc, current_font, segment, textp - segment);
+            draw_clipped(L, fc, current_font, segment, textp - segment, x, width, y, color, clip_left, clip_right);
+            x += width;
+        }
+    }
+    count_segments(fc, segments);
+    return x;
+}
+
+// optional clip_right and clip_left arguments, after the tab offset table if there is one
+static int get_clip(lua_State *L, int idx, double *clip_left, double *clip_right)
+{
+    if (lua_type(L, idx) != LUA_TNUMBER)
+        idx++;
+    *clip_right = luaL_optnumber(L, idx, HUGE_VAL);
+    *clip_left = luaL_optnumber(L, idx + 1, -HUGE_VAL);
+    return idx;
+}
+
+static int f_draw_text(lua_State *L)
+{
+    size_t len = 0;
+
+    double clip_left, clip_right;
+
+    // check if the input is a regular Font, if yes then pass on
+    if (!luaL_testudata(L, 1, LFC_TYPE_FCFONT))
+    {
+        // the renderer does not know about the clip arguments
+        if (lua_gettop(L) >= 6)
+            lua_settop(L, get_clip(L, 6, &clip_left, &clip_right) - 1);
+        draw_queue_flush(L);
+        if (get_callback(L, callbacks.draw_text) != 0)
+            return luaL_error(L, "cannot get renderer.draw_text()");
+        lua_insert(L, 1); // -> [function, ...args]
+        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
+        return lua_gettop(L);
+    }
+
+    FcFont *fc = check_fcfont(L, 1);
+    const char *text = luaL_checklstring(L, 2, &len);
+    double x = luaL_checknumber(L, 3);
+    double y = luaL_checknumber(L, 4);
+    luaL_checktype(L, 5, LUA_TTABLE);
+    double origin = x - get_tab_offset(L, 6);
+    get_clip(L, 6, &clip_left, &clip_right);
+
+    lua_pushnumber(L, draw_pieces(L, fc, text, len, x, y, 5, origin, clip_left, clip_right));
+    return 1;
+}
+
+// draws the string at the top of the stack with the color at index color, and pops it
+static double draw_batch_text(lua_State *L, FcFont *fc, double x, double y, int color, double origin)
+{
+    size_t len;
+    const char *text;
+    if (fc)
+    {
+        text = luaL_checklstring(L, -1, &len);
+        x = draw_pieces(L, fc, text, len, x, y, color, origin, -HUGE_VAL, HUGE_VAL);
+        lua_pop(L, 1);
+        return x;
+    }
+    // -> [text]
+    draw_queue_flush(L);
+    if (get_callback(L, callbacks.draw_text) != 0)
+        return luaL_error(L, "cannot get renderer.draw_text()");
+    // -> [text, draw_text]
+    lua_insert(L, -2);       // -> [draw_text, text]
+    lua_pushvalue(L, 1);     // -> [draw_text, text, font]
+    lua_insert(L, -2);       // -> [draw_text, font, text]
+    lua_pushnumber(L, x);    // -> [draw_text, font, text, x]
+    lua_pushnumber(L, y);    // -> [draw_text, font, text, x, y]
+    lua_pushvalue(L, color); // -> [draw_text, font, text, x, y, color]
+    lua_call(L, 5, 1);       // -> [new_x]
+    x = lua_tonumber(L, -1);
+    lua_pop(L, 1); // -> []
+    return x;
+}
+
+// Draws many texts in one call. Each item is either {text, x, y, color}, or {tokens, x, y}
+// where tokens is {text, color, text, color, ...} drawn one after another from x.
+// Returns the end x of every item.
+static int f_draw_batch(lua_State *L)
+{
+    FcFont *fc = luaL_testudata(L, 1, LFC_TYPE_FCFONT) ? check_fcfont(L, 1) : NULL;
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_settop(L, 2);
+    lua_Integer n = luaL_len(L, 2);
+    lua_createtable(L, n, 0); // -> [results]
+    for (lua_Integer i = 1; i <= n; i++)
+    {
+        if (lua_rawgeti(L, 2, i) != LUA_TTABLE) // -> [results, item]
+            return luaL_error(L, "item %d is not a table", (int)i);
+        lua_rawgeti(L, 4, 2); // -> [results, item, x]
+        lua_rawgeti(L, 4, 3); // -> [results, item, x, y]
+        double x = luaL_checknumber(L, -2), origin = x;
+        double y = luaL_checknumber(L, -1);
+        lua_pop(L, 2);
+        if (lua_rawgeti(L, 4, 1) == LUA_TTABLE) // -> [results, item, tokens]
+        {
+            lua_Integer ntokens = luaL_len(L, 5);
+            for (lua_Integer j = 1; j + 1 <= ntokens; j += 2)
+            {
+                lua_rawgeti(L, 5, j + 1); // -> [results, item, tokens, color]
+                luaL_checktype(L, 6, LUA_TTABLE);
+                lua_rawgeti(L, 5, j); // -> [results, item, tokens, color, text]
+                x = draw_batch_text(L, fc, x, y, 6, origin);
+                lua_pop(L, 1); // -> [results, item, tokens]
+            }
+            lua_pop(L, 1); // -> [results, item]
+        }
+        else
+        { // -> [results, item, text]
+            lua_rawgeti(L, 4, 4); // -> [results, item, text, color]
+            luaL_checktype(L, 6, LUA_TTABLE);
+            lua_insert(L, 5); // -> [results, item, color, text]
+            x = draw_batch_text(L, fc, x, y, 5, origin);
+            lua_pop(L, 1); // -> [results, item]
+        }
+        lua_pop(L, 1);         // -> [results]
+        lua_pushnumber(L, x);  // -> [results, x]
+        lua_rawseti(L, 3, i);  // -> [results]
+    }
+    return 1;
+}
+
+static int f_copy(lua_State *L)
+{
+    FcFont *font = check_fcfont(L, 1);
+    luaL_checknumber(L, 2);
+    // push the base pattern serialized into a string, and call f_load
+    FcChar8 *pattern_str = FcNameUnparse(font->patterns[0]);
+    if (!pattern_str)
+        return luaL_error(L, "cannot unparse base pattern");
+    lua_pushstring(L, (const char *) pattern_str); // -> [font, size, ..., pattern]
+    free(pattern_str);
+    lua_replace(L, 1); // -> [pattern, size, ...]
+    return f_load(L);
+}
+
+// lite-xl groups hold at most FONT_FALLBACK_MAX fonts
+#define LFC_GROUP_MAX 10
+
+// Returns a renderer font group of the primary font and the fallbacks used most so far, in
+// chain order, so that text can be drawn by the renderer without segmenting it. The group is
+// kept in the user value of the font and rebuilt when a new fallback is used or the font changes.
+static int f_to_group(lua_State *L)
+{
+    FcFont *fc = check_fcfont(L, 1);
+    int max_fonts = luaL_optinteger(L, 2, LFC_GROUP_MAX);
+    int picked[LFC_GROUP_MAX], npicked = 1, nfonts = 0;
+    luaL_argcheck(L, max_fonts >= 1 && max_fonts <= LFC_GROUP_MAX, 2, "must be between 1 and 10");
+    lua_settop(L, 2);
+
+    if (!fc->group_dirty && fc->group_generation == fc->generation && fc->group_max == max_fonts &&
+        lua_getiuservalue(L, 1, 1) != LUA_TNIL) // -> [group]
+        return 1;
+    lua_settop(L, 2);
+
+    picked[0] = 0;
+    while (fc->uses && npicked < max_fonts)
+    {
+        int best = 0;
+        for (int i = 1; i < fc->n; i++)
+        {
+            int taken = 0;
+            for (int j = 1; j < npicked && !taken; j++)
+                taken = picked[j] == i;
+            if (!taken && fc->uses[i] > (best ? fc->uses[best] : 0))
+                best = i;
+        }
+        if (!best)
+            break;
+        // insertion keeps the fallbacks in chain order
+        int j = npicked++;
+        for (; j > 1 && picked[j - 1] > best; j--)
+            picked[j] = picked[j - 1];
+        picked[j] = best;
+    }
+
+    if (get_callback(L, callbacks.group) != 0)
+        return luaL_error(L, "cannot get font.group()");
+    // -> [group_fn]
+    lua_createtable(L, npicked, 0); // -> [group_fn, fonts]
+    for (int i = 0; i < npicked; i++)
+    {
+        if (get_font_cache(L, fc, picked[i]) == 0) // -> [group_fn, fonts, font]
+            lua_rawseti(L, -2, ++nfonts);          // -> [group_fn, fonts]
+    }
+    if (nfonts == 0)
+        return luaL_error(L, "cannot load font");
+    lua_call(L, 1, 1);           // -> [group]
+    lua_pushvalue(L, -1);        // -> [group, group]
+    lua_setiuservalue(L, 1, 1);  // -> [group]
+    fc->group_dirty = 0;
+    fc->group_max = max_fonts;
+    fc->group_generation = fc->generation;
+    return 1;
+}
+
+// pen positions at every codepoint boundary of a text, boundary k starts at byte bytes[k]
+typedef struct LFCOffsets
+{
+    double *xs;
+    size_t *bytes;
+    size_t n;
+} LFCOffsets;
+
+static void add_offset(LFCOffsets *offsets, const char *text, const char *p, double x)
+{
+    offsets->xs[offsets->n] = x;
+    offsets->bytes[offsets->n++] = p - text;
+}
+
+// measures a piece returned by next_piece() codepoint by codepoint
+static double piece_offsets(lua_State *L, FcFont *fc, int font, int blank, const char *text,
+                            const char *segment, const char *end, double x, LFCOffsets *offsets)
+{
+    const char *p, *next;
+    unsigned codepoint;
+    LFCCacheEntry *entry;
+    double width;
+    if (blank)
+    {
+        for (p = segment; p < end; p++)
+            add_offset(offsets, text, p + 1, x = blank_advance(L, fc, p, p + 1, x));
+    }
+    else if (fc->width_engine == LFC_WIDTH_NATIVE && (entry = get_font_entry(L, fc, font)) &&
+             face_text_width(L, entry, segment, end - segment, 0, &width) == 0)
+    {
+        for (p = segment; p < end; p = next)
+        {
+            next = utf8_decode(p, end, &codepoint);
+            x += face_char_advance(entry->face, codepoint, entry->face->deltas, 1);
+            add_offset(offsets, text, next, x);
+        }
+    }
+    else
+    {
+        // the renderer does not kern, so codepoints can be measured one by one
+        for (p = segment; p < end; p = next)
+        {
+            next = utf8_decode(p, end, &codepoint);
+            x += get_width(L, fc, font, p, next - p);
+            add_offset(offsets, text, next, x);
+        }
+    }
+    return x;
+}
+
+// allocates the offsets of a text in a userdata pushed on the stack
+static void new_offsets(lua_State *L, size_t len, LFCOffsets *offsets)
+{
+    offsets->xs = lua_newuserdatauv(L, (len + 1) * (sizeof(double) + sizeof(size_t)), 0); // -> [offsets]
+    offsets->bytes = (size_t *)(offsets->xs + len + 1);
+    offsets->n = 0;
+}
+
+// measures text in a single pass
+static void get_offsets(lua_State *L, FcFont *fc, const char *text, size_t len, double x, LFCOffsets *offsets)
+{
+    const char *textp = text, *end = text + len;
+    int current_font = 0, blank;
+
+    new_offsets(L, len, offsets); // -> [offsets]
+    add_offset(offsets, text, textp, x);
+    while (textp < end)
+    {
+        const char *segment = textp;
+        textp = next_piece(fc, textp, end, &current_font, &blank);
+        x = piece_offsets(L, fc, current_font, blank, text, segment, textp, x, offsets);
+    }
+}
+
+static void push_offsets(lua_State *L, LFCOffsets *offsets, double origin)
+{
+    lua_createtable(L, offsets->n, 0); // -> [xs]
+    lua_createtable(L, offsets->n, 0); // -> [xs, bytes]
+    for (size_t i = 0; i < offsets->n; i++)
+    {
+        lua_pushnumber(L, offsets->xs[i] - origin); // -> [xs, bytes, x]
+        lua_rawseti(L, -3, i + 1);                  // -> [xs, bytes]
+        lua_pushinteger(L, offsets->bytes[i] + 1);  // -> [xs, bytes, byte]
+        lua_rawseti(L, -2, i + 1);                  // -> [xs, bytes]
+    }
+}
+
+// returns the 1-based byte index of the codepoint boundary closest to x
+static size_t find_offset(LFCOffsets *offsets, double x)
+{
+    size_t lo = 0, hi = offsets->n - 1;
+    // find the last boundary at or before x
+    while (lo < hi)
+    {
+        size_t mid = (lo + hi + 1) / 2;
+        if (offsets->xs[mid] <= x)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    if (lo + 1 < offsets->n && offsets->xs[lo + 1] - x < x - offsets->xs[lo])
+        lo++;
+    return offsets->bytes[lo] + 1;
+}
+
+// Widths of many lines can be computed on a pool of worker threads. The workers segment with
+// a snapshot of the chain and measure with their own FreeType faces, opened from the faces
+// validated on the main thread. Lines that need a font without a validated face are left as
+// NaN, and the main thread measures them when the results are collected.
+#define LFC_WIDTH_CHUNK 512
+
+typedef struct LFCFaceTemplate
+{
+    char *file; // NULL if the font has no native face yet
+    double size;
+    LFCFace face;
+} LFCFaceTemplate;
+
+typedef struct LFCWidthJob
+{
+    LFCMutex mutex;
+    LFCCond cond;
+    int refs, running, cancelled;
+    FcFont font; // segmentation state of the chain, with the whole coverage resolved
+    LFCFaceTemplate *templates;
+    double space_width;
+    char *text;
+    size_t *starts; // line i is text[starts[i]..starts[i + 1]]
+    size_t nlines, next_line, done;
+    double *widths;
+    int resolved;
+} LFCWidthJob;
+
+static void width_job_release(LFCWidthJob *job)
+{
+    int refs;
+    lfc_mutex_lock(&job->mutex);
+    refs = --job->refs;
+    lfc_mutex_unlock(&job->mutex);
+    if (refs > 0)
+        return;
+    for (int i = 0; i < job->font.n; i++)
+    {
+        if (job->font.charsets && job->font.charsets[i])
+            FcCharSetDestroy(job->font.charsets[i]);
+        if (job->templates)
+            free(job->templates[i].file);
+    }
+    free(job->font.charsets);
+    free(job->font.loadable);
+    coverage_free(job->font.coverage);
+    free(job->templates);
+    free(job->text);
+    free(job->starts);
+    free(job->widths);
+    lfc_cond_destroy(&job->cond);
+    lfc_mutex_destroy(&job->mutex);
+    free(job);
+}
+
+static LFCFace *worker_face(FT_Library library, LFCFaceTemplate *template)
+{
+    LFCFace *face = calloc(1, sizeof(LFCFace));
+    if (!face)
+        return NULL;
+    *face = template->face;
+    face->face = NULL;
+    if (FT_New_Face(library, template->file, 0, &face->face) != 0)
+    {
+        face->face = NULL;
+        goto fail;
+    }
+    if (FT_Set_Pixel_Sizes(face->face, 0, (int)template->size) != 0 || !(face->pages = calloc(sizeof(float *), LFC_ADVANCE_PAGES)))
+        goto fail;
+    return face;
+fail:
+    face_free(face);
+    return NULL;
+}
+
+// measures a line with the faces of a worker, fails if a font has to be measured on the main thread
+static int worker_text_width(LFCWidthJob *job, FT_Library library, LFCFace **faces, const char *text, size_t len, double *width)
+{
+    FcFont *fc = &job->font;
+    const char *textp = text, *end = text + len;
+    int current_font = 0, blank;
+    double x = 0, segment_width;
+    while (textp < end)
+    {
+        const char *segment = textp;
+        textp = next_piece(fc, textp, end, &current_font, &blank);
+        if (blank)
+        {
+            x = blank_advance_by(job->space_width, fc->tab_size, segment, textp, x);
+            continue;
+        }
+        if (!faces[current_font] && job->templates[current_font].file)
+            faces[current_font] = worker_face(library, &job->templates[current_font]);
+        if (!faces[current_font] ||
+            face_measure(faces[current_font], segment, textp - segment, current_font == 0 && fc->monospace, &segment_width) != 0)
+            return -1;
+        x += segment_width;
+    }
+    *width = x;
+    return 0;
+}
+
+static LFC_THREAD_FUNC(width_worker)
+{
+    LFCWidthJob *job = arg;
+    FT_Library library = NULL;
+    LFCFace **faces = calloc(sizeof(LFCFace *), job->font.n);
+    if (faces && FT_Init_FreeType(&library) != 0)
+        library = NULL;
+
+    for (;;)
+    {
+        size_t first, last;
+        lfc_mutex_lock(&job->mutex);
+        first = job->next_line;
+        last = first + LFC_WIDTH_CHUNK < job->nlines ? first + LFC_WIDTH_CHUNK : job->nlines;
+        job->next_line = last;
+        if (job->cancelled)
+            first = last;
+        lfc_mutex_unlock(&job->mutex);
+        if (first == last)
+            break;
+
+        for (size_t i = first; i < last && library; i++)
+        {
+            double width;
+            if (worker_text_width(job, library, faces, job->text + job->starts[i], job->starts[i + 1] - job->starts[i], &width) == 0)
+                job->widths[i] = width;
+        }
+
+        lfc_mutex_lock(&job->mutex);
+        job->done += last - first;
+        lfc_cond_broadcast(&job->cond);
+        lfc_mutex_unlock(&job->mutex);
+    }
+
+    for (int i = 0; faces && i < job->font.n; i++)
+        face_free(faces[i]);
+    free(faces);
+    if (library)
+        FT_Done_FreeType(library);
+
+    lfc_mutex_lock(&job->mutex);
+    job->running--;
+    lfc_cond_broadcast(&job->cond);
+    lfc_mutex_unlock(&job->mutex);
+    width_job_release(job);
+    LFC_THREAD_RETURN;
+}
+
+static int get_cpu_count(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? count : 1;
+#endif
+}
+
+// copies the state the workers need, resolving the whole chain so that they never extend it
+static int width_job_snapshot(lua_State *L, FcFont *fc, LFCWidthJob *job)
+{
+    LFCCacheEntry *entry;
+    double width;
+    FcFont *font = &job->font;
+
+    if (fcfont_extend_all(fc) < 0)
+        return -1;
+    font->n = fc->n;
+    font->covered = fc->n;
+    font->tab_size = fc->tab_size;
+    font->monospace = fc->monospace;
+    font->ascii_primary = fc->ascii_primary;
+    font->fallback_mode = fc->fallback_mode;
+    if (fc->fallback_mode == LFC_FALLBACK_LONGEST)
+    {
+        for (int i = 0; i < fc->n; i++)
+            fcfont_loadable(fc, i);
+        if (!fc->loadable || !(font->loadable = malloc(fc->n)))
+            return -1;
+        memcpy(font->loadable, fc->loadable, fc->n);
+    }
+    if (!(font->coverage = malloc(sizeof(LFCCoverage))) ||
+        !(font->coverage->blocks = malloc(sizeof(*fc->coverage->blocks) * fc->coverage->nblocks)))
+    {
+        free(font->coverage);
+        font->coverage = NULL;
+        return -1;
+    }
+    memcpy(font->coverage->stage1, fc->coverage->stage1, sizeof(fc->coverage->stage1));
+    memcpy(font->coverage->blocks, fc->coverage->blocks, sizeof(*fc->coverage->blocks) * fc->coverage->nblocks);
+    font->coverage->nblocks = fc->coverage->nblocks;
+    if (!(font->charsets = calloc(sizeof(FcCharSet *), fc->n)) || !(job->templates = calloc(sizeof(LFCFaceTemplate), fc->n)))
+        return -1;
+    for (int i = 0; i < fc->n; i++)
+    {
+        FcCharSet *charset = fcfont_charset(fc, i);
+        if (!(font->charsets[i] = charset ? FcCharSetCopy(charset) : FcCharSetCreate()))
+            return -1;
+    }
+
+    if (fc->width_engine != LFC_WIDTH_NATIVE)
+        return 0;
+    // the primary font is validated now, the others only if they were used before
+    if ((entry = get_font_entry(L, fc, 0)))
+        face_text_width(L, entry, "", 0, 0, &width);
+    if (fc->tab_size > 0)
+        job->space_width = get_space_width(L, fc);
+    if (fc->entries_generation != font_cache.generation)
+        clear_font_entries(fc, 0);
+    for (int i = 0; i < fc->n; i++)
+    {
+        if (!(entry = fc->entries[i]) || entry->face_state != LFC_FACE_NATIVE)
+            continue;
+        if (!(job->templates[i].file = strdup(entry->file)))
+            return -1;
+        job->templates[i].size = entry->size;
+        job->templates[i].face = *entry->face;
+        job->templates[i].face.face = NULL;
+        job->templates[i].face.pages = NULL;
+    }
+    return 0;
+}
+
+// -> [job], measures an array of strings on worker threads
+static int f_get_widths_async(lua_State *L)
+{
+    FcFont *fc = check_fcfont(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    lua_Integer n = luaL_len(L, 2);
+    int threads = luaL_optinteger(L, 3, get_cpu_count());
+    size_t size = 0;
+
+    LFCWidthJob **handle = lua_newuserdatauv(L, sizeof(LFCWidthJob *), 1); // -> [job]
+    *handle = NULL;
+    luaL_setmetatable(L, LFC_TYPE_WIDTH_JOB);
+    lua_pushvalue(L, 1);         // -> [job, font]
+    lua_setiuservalue(L, -2, 1); // -> [job]
+
+    LFCWidthJob *job = *handle = calloc(1, sizeof(LFCWidthJob));
+    if (!job)
+        return luaL_error(L, "cannot allocate width job");
+    job->refs = 1;
+    lfc_mutex_init(&job->mutex);
+    lfc_cond_init(&job->cond);
+
+    // copy the lines, the workers cannot touch Lua strings
+    for (lua_Integer i = 1; i <= n; i++)
+    {
+        size_t len;
+        lua_rawgeti(L, 2, i); // -> [job, text]
+        if (!lua_tolstring(L, -1, &len))
+            return luaL_error(L, "line %d is not a string", (int)i);
+        size += len;
+        lua_pop(L, 1); // -> [job]
+    }
+    job->nlines = n;
+    if (!(job->text = malloc(size + 1)) || !(job->starts = malloc(sizeof(size_t) * (n + 1))) ||
+        !(job->widths = malloc(sizeof(double) * (n + 1))))
+        return luaL_error(L, "cannot allocate width job");
+    for (lua_Integer i = 0; i < n; i++)
+        job->widths[i] = NAN;
+    size = 0;
+    for (lua_Integer i = 1; i <= n; i++)
+    {
+        size_t len;
+        lua_rawgeti(L, 2, i); // -> [job, text]
+        const char *text = lua_tolstring(L, -1, &len);
+        memcpy(job->text + size, text, len);
+        job->starts[i - 1] = size;
+        size += len;
+        lua_pop(L, 1); // -> [job]
+    }
+    job->starts[n] = size;
+
+    if (width_job_snapshot(L, fc, job) != 0)
+        return luaL_error(L, "cannot allocate width job");
+    ft_init();
+    if (threads > (n + LFC_WIDTH_CHUNK - 1) / LFC_WIDTH_CHUNK)
+        threads = (n + LFC_WIDTH_CHUNK - 1) / LFC_WIDTH_CHUNK;
+    if (ft_state != 1 || !job->templates[0].file)
+        threads = 0;
+    for (int i = 0; i < threads; i++)
+    {
+        lfc_mutex_lock(&job->mutex);
+        job->refs++;
+        job->running++;
+        lfc_mutex_unlock(&job->mutex);
+        if (lfc_thread_start(width_worker, job) != 0)
+        {
+            lfc_mutex_lock(&job->mutex);
+            job->refs--;
+            job->running--;
+            lfc_mutex_unlock(&job->mutex);
+            break;
+        }
+    }
+    return 1;
+}
+
+static LFCWidthJob *check_width_job(lua_State *L, int idx)
+{
+    LFCWidthJob **handle = luaL_checkudata(L, idx, LFC_TYPE_WIDTH_JOB);
+    if (!*handle)
+        luaL_error(L, "attempt to use a released width job");
+    return *handle;
+}
+
+// -> done, total
+static int f_width_job_progress(lua_State *L)
+{
+    LFCWidthJob *job = check_width_job(L, 1);
+    lfc_mutex_lock(&job->mutex);
+    // lines are only counted once their chunk is finished, all of them once the workers are gone
+    size_t done = job->running ? job->done : job->nlines;
+    lfc_mutex_unlock(&job->mutex);
+    lua_pushinteger(L, done);
+    lua_pushinteger(L, job->nlines);
+    return 2;
+}
+
+// -> [widths], measures the lines left by the workers once they are done
+static void width_job_push_results(lua_State *L, LFCWidthJob *job)
+{
+    if (job->cancelled)
+    {
+        lua_pushnil(L);
+        return;
+    }
+    if (!job->resolved)
+    {
+        lua_getiuservalue(L, 1, 1); // -> [font]
+        FcFont *fc = check_fcfont(L, -1);
+        lua_pop(L, 1); // -> []
+        for (size_t i = 0; i < job->nlines; i++)
+        {
+            if (isnan(job->widths[i]))
+                job->widths[i] = text_width(L, fc, job->text + job->starts[i], job->starts[i + 1] - job->starts[i], 0);
+        }
+        job->resolved = 1;
+    }
+    lua_createtable(L, job->nlines, 0); // -> [widths]
+    for (size_t i = 0; i < job->nlines; i++)
+    {
+        lua_pushnumber(L, job->widths[i]); // -> [widths, width]
+        lua_rawseti(L, -2, i + 1);         // -> [widths]
     }
-    if (set)
-        FcFontSetDestroy(set);
-    if (base_pattern)
-        FcPatternDestroy(base_pattern);
-    return lua_error(L);
 }
 
-static inline const char *utf8_to_codepoint(const char *p, unsigned *dst)
+// -> widths, or nil if the workers are still running or the job was cancelled
+static int f_width_job_results(lua_State *L)
 {
-    const unsigned char *up = (unsigned char *)p;
-    unsigned res, n;
-    switch (*p & 0xf0)
+    LFCWidthJob *job = check_width_job(L, 1);
+    lfc_mutex_lock(&job->mutex);
+    int running = job->running;
+    lfc_mutex_unlock(&job->mutex);
+    if (running)
     {
-    case 0xf0:
-        res = *up & 0x07;
-        n = 3;
-        break;
-    case 0xe0:
-        res = *up & 0x0f;
-        n = 2;
-        break;
-    case 0xd0:
-    case 0xc0:
-        res = *up & 0x1f;
-        n = 1;
-        break;
-    default:
-        res = *up;
-        n = 0;
-        break;
-    }
-    while (n--)
-    {
-        res = (res << 6) | (*(++up) & 0x3f);
+        lua_pushnil(L);
+        return 1;
     }
-    *dst = res;
-    return (const char *)up + 1;
+    width_job_push_results(L, job);
+    return 1;
 }
 
-static int get_function(lua_State *L, const char *table, const char *function)
+// -> widths, blocks until the workers are done
+static int f_width_job_wait(lua_State *L)
 {
-    if (lua_getfield(L, LUA_REGISTRYINDEX, table) != LUA_TTABLE)
-    { // -> [nil]
-        lua_pop(L, 1);
-        return -1;
-    } // -> [table]
-    if (lua_getfield(L, -1, function) != LUA_TFUNCTION)
-    { // -> [table, nil]
-        lua_pop(L, 2);
-        return -1;
-    } // -> [table, function]
-    lua_remove(L, lua_gettop(L) - 1); // -> [function]
-    return 0;
+    LFCWidthJob *job = check_width_job(L, 1);
+    lfc_mutex_lock(&job->mutex);
+    while (job->running)
+        lfc_cond_wait(&job->cond, &job->mutex);
+    lfc_mutex_unlock(&job->mutex);
+    width_job_push_results(L, job);
+    return 1;
 }
 
-static double get_time()
+static int f_width_job_cancel(lua_State *L)
 {
-#ifdef _WIN32
-    return (double) GetTickCount() / 1000;
-#else
-    struct timespec spec;
-    clock_gettime(CLOCK_MONOTONIC, &spec);
-    return spec.tv_sec + spec.tv_nsec / 1.0e9;
-#endif
+    LFCWidthJob *job = check_width_job(L, 1);
+    lfc_mutex_lock(&job->mutex);
+    job->cancelled = 1;
+    lfc_mutex_unlock(&job->mutex);
+    return 0;
 }
 
-static int get_font_cache(lua_State *L, FcPattern *pattern)
+static int f_width_job_gc(lua_State *L)
 {
-    if (lua_getfield(L, LUA_REGISTRYINDEX, LFC_FONT_CACHE) != LUA_TTABLE)
-    {                                                       // -> [nil]
-        lua_pop(L, 1);                                      // -> []
-        lua_newtable(L);                                    // -> [cache]
-        lua_pushinteger(L, 0);                              // -> [cache, 0]
-        lua_rawseti(L, -2, 1);                              // -> [cache]
-        lua_pushvalue(L, -1);                               // -> [cache, cache]
-        lua_setfield(L, LUA_REGISTRYINDEX, LFC_FONT_CACHE); // -> [cache]
-    } // -> [cache]
-    double pixel_size;
-    const char *filename;
-    if (FcPatternGetString(pattern, FC_FILE, 0, (unsigned char **)&filename) != FcResultMatch)
-    {
-        lua_pop(L, 1);
-        return -1;
-    }
-    if (FcPatternGetDouble(pattern, FC_PIXEL_SIZE, 0, &pixel_size) != FcResultMatch)
-    {
-        lua_pop(L, 1);
-        return -1;
-    }
-    if (lua_rawgeti(L, -1, FcPatternHash(pattern)) == LUA_TNIL)
-    {                                               // -> [cache, nil]
-        lua_pop(L, 1);                              // -> [cache]
-        if (get_function(L, LFC_FONT, "load") != 0) // -> [cache]
-        {
-            return luaL_error(L, "cannot get font.load()");
-        } // -> [cache, font.load]
-        // TODO: figure out how to pass extra stuff
-        lua_pushstring(L, filename);   // -> [cache, font.load, filename]
-        lua_pushnumber(L, pixel_size); // -> [cache, font.load, filename, size]
-        if (lua_pcall(L, 2, 1, 0) != LUA_OK)
-        { // -> [cache, error]
-            lua_pop(L, 2);
-            return -1;
-        } // -> [cache, font]
-        lua_createtable(L, 2, 0);                     // -> [cache, font, fonttable]
-        lua_rotate(L, lua_gettop(L) - 1, -1);         // -> [cache, fon  ttable, font]
-        lua_rawseti(L, -2, 1);                        // -> [cache, fonttable]
-        lua_pushinteger(L, FcPatternHash(pattern));   // -> [cache, fonttable, hash]
-        lua_pushvalue(L, -2);                         // -> [cache, fonttable, hash, fonttable]
-        lua_rawset(L, -4);                            // -> [cache, fonttable]
-        lua_rawgeti(L, -2, 1);                        // -> [cache, fonttable, len]
-        lua_pushinteger(L, lua_tointeger(L, -1) + 1); // -> [cache, fonttable, len, len+1]
-        lua_rawseti(L, -4, 1);                        // -> [cache, fonttable, len]
-        lua_pop(L, 1);                                // -> [cache, fonttable]
-    } // -> [cache, fonttable]
-    lua_remove(L, lua_gettop(L) - 1); // -> [fonttable]
-    lua_pushnumber(L, get_time());    // -> [fonttable, ttl]
-    lua_rawseti(L, -2, 2);            // -> [fonttable]
-    lua_rawgeti(L, -1, 1);            // -> [fonttable, font]
-    lua_remove(L, lua_gettop(L) - 1); // -> [font]
+    LFCWidthJob **handle = luaL_checkudata(L, 1, LFC_TYPE_WIDTH_JOB);
+    if (!*handle)
+        return 0;
+    lfc_mutex_lock(&(*handle)->mutex);
+    (*handle)->cancelled = 1;
+    lfc_mutex_unlock(&(*handle)->mutex);
+    width_job_release(*handle);
+    *handle = NULL;
     return 0;
 }
 
-static double get_width(lua_State *L, FcFont *font, int i, const char *str, size_t len)
+static int f_get_offsets(lua_State *L)
 {
-    if (get_function(L, LFC_FONT, "get_width") != 0)
-    {
-        return luaL_error(L, "cannot get font.get_width()");
-    } // -> [get_width]
-    unsigned char *name;
-    if (FcPatternGetString(font->patterns[i], FC_FILE, 0, &name) == FcResultTypeMismatch)
-    {
-        lua_pop(L, 1);
-        return 0;
-    }
-    if (get_font_cache(L, font->patterns[i]) != 0)
-    {
-        lua_pop(L, 1);
-        return 0;
-    } // -> [get_width, font]
-    lua_pushlstring(L, str, len); // -> [get_width, font, string]
-    lua_call(L, 2, 1);            // -> [width]
-    double width = lua_tonumber(L, -1);
-    lua_pop(L, 1); // -> []
-    return width;
+    size_t len = 0;
+    LFCOffsets offsets;
+    FcFont *fc = check_fcfont(L, 1);
+    const char *text = luaL_checklstring(L, 2, &len);
+    double offset = get_tab_offset(L, 3);
+
+    get_offsets(L, fc, text, len, offset, &offsets); // -> [offsets]
+    push_offsets(L, &offsets, offset);               // -> [offsets, xs, bytes]
+    return 2;
 }
 
-static int f_get_width(lua_State *L)
+static int f_x_to_byte(lua_State *L)
 {
     size_t len = 0;
-    FcFont *fc = luaL_checkudata(L, 1, LFC_TYPE_FCFONT);
+    LFCOffsets offsets;
+    FcFont *fc = check_fcfont(L, 1);
     const char *text = luaL_checklstring(L, 2, &len);
-    const char *textp = text, *last_segment = text;
+    double x = luaL_checknumber(L, 3);
+    double offset = get_tab_offset(L, 4);
+
+    get_offsets(L, fc, text, len, offset, &offsets); // -> [offsets]
+    lua_pushinteger(L, find_offset(&offsets, x + offset));
+    return 1;
+}
+
+// A TextLayout keeps the pieces of a text, so that it can be measured and drawn repeatedly
+// without segmenting it again. It is rebuilt when the generation of its font changes.
+typedef struct LFCRun
+{
+    size_t start, end;
+    int font, blank;
+    double width;
+} LFCRun;
 
-    int current_font = 0;
-    int first = 1;
+typedef struct LFCLayout
+{
+    char *text;
+    size_t len;
+    double tab_offset;
+    LFCRun *runs;
+    size_t nruns, runs_size;
+    double width;
+    unsigned generation;
+    int valid;
+} LFCLayout;
+
+static void layout_build(lua_State *L, FcFont *fc, LFCLayout *layout)
+{
+    const char *textp = layout->text, *end = layout->text + layout->len;
+    int current_font = 0, blank;
+    double x = layout->tab_offset;
 
-    double width = 0;
-    unsigned int codepoint;
-    while (textp < (text + len))
+    layout->valid = 0;
+    layout->nruns = 0;
+    while (textp < end)
     {
-        const char *prev_textp = textp;
-        textp = utf8_to_codepoint(textp, &codepoint);
-        if (!FcCharSetHasChar(fc->charsets[current_font], codepoint))
+        const char *segment = textp;
+        LFCRun *run;
+        textp = next_piece(fc, textp, end, &current_font, &blank);
+        if (layout->nruns == layout->runs_size)
         {
-            // select a new font
-            int new_font = 0;
-            for (int i = 0; i < fc->n; i++)
-            {
-                if (FcCharSetHasChar(fc->charsets[i], codepoint))
-                {
-                    new_font = i;
-                    break;
-                }
-            }
-            if (!first)
-            {
-                // process previous font
-                width += get_width(L, fc, current_font, last_segment, textp - last_segment);
-            }
-            first = 0;
-            last_segment = prev_textp;
-            current_font = new_font;
+            size_t size = layout->runs_size ? layout->runs_size * 2 : 8;
+            LFCRun *runs = realloc(layout->runs, sizeof(LFCRun) * size);
+            if (!runs)
+                luaL_error(L, "cannot allocate text layout");
+            layout->runs = runs;
+            layout->runs_size = size;
         }
+        run = &layout->runs[layout->nruns++];
+        run->start = segment - layout->text;
+        run->end = textp - layout->text;
+        run->font = current_font;
+        run->blank = blank;
+        if (blank)
+            run->width = blank_advance(L, fc, segment, textp, x) - x;
         else
-        {
-            continue;
-        }
+            run->width = get_width(L, fc, current_font, segment, textp - segment);
+        x += run->width;
     }
-    if (last_segment <= textp)
-        width += get_width(L, fc, current_font, last_segment, textp - last_segment);
-    lua_pushnumber(L, width);
-    return 1;
+    layout->width = x - layout->tab_offset;
+    layout->generation = fc->generation;
+    layout->valid = 1;
 }
 
-static double draw_text(lua_State *L, FcFont *font, int i, const char *str, size_t len, double x, double y, int color)
+// returns the layout, rebuilt if its font changed since it was built
+static LFCLayout *check_layout(lua_State *L, int idx, FcFont **fc)
 {
-    if (get_function(L, LFC_RENDERER, "draw_text") != 0)
-    {
-        return luaL_error(L, "cannot get renderer.draw_text()");
-    } // -> [draw_text]
-    unsigned char *name;
-    if (FcPatternGetString(font->patterns[i], FC_FILE, 0, &name) == FcResultTypeMismatch)
-    {
-        lua_pop(L, 1);
-        return 0;
-    }
-    if (get_font_cache(L, font->patterns[i]) != 0)
-    {
-        lua_pop(L, 1);
-        return 0;
-    } // -> [draw_text]
-    lua_pushlstring(L, str, len); // -> [draw_text, text]
-    lua_pushnumber(L, x);         // -> [draw_text, text, x]
-    lua_pushnumber(L, y);         // -> [draw_text, text, x, y]
-    lua_pushvalue(L, color);      // -> [draw_text, text, x, y, color]
-    lua_call(L, 5, 1);            // -> [new_x]
-    double new_x = lua_tonumber(L, -1);
-    lua_pop(L, 1); // -> []
-    return new_x;
+    LFCLayout *layout = luaL_checkudata(L, idx, LFC_TYPE_LAYOUT);
+    lua_getiuservalue(L, idx, 1); // -> [font]
+    *fc = check_fcfont(L, -1);
+    lua_pop(L, 1); // -> [], the layout keeps the font alive
+    if (!layout->valid || layout->generation != (*fc)->generation)
+        layout_build(L, *fc, layout);
+    return layout;
 }
 
-static int f_draw_text(lua_State *L)
+static int f_layout(lua_State *L)
 {
     size_t len = 0;
-
-    // check if the input is a regular Font, if yes then pass on
-    if (!luaL_testudata(L, 1, LFC_TYPE_FCFONT))
-    {
-        if (get_function(L, LFC_RENDERER, "draw_text") != 0)
-            return luaL_error(L, "cannot get renderer.draw_text()");
-        lua_insert(L, 1); // -> [function, ...args]
-        lua_call(L, lua_gettop(L) - 1, LUA_MULTRET);
-        return lua_gettop(L);
-    }
-
-    FcFont *fc = luaL_checkudata(L, 1, LFC_TYPE_FCFONT);
+    FcFont *fc = check_fcfont(L, 1);
     const char *text = luaL_checklstring(L, 2, &len);
-    double x = luaL_checknumber(L, 3);
-    double y = luaL_checknumber(L, 4);
-    luaL_checktype(L, 5, LUA_TTABLE);
+    LFCLayout *layout = lua_newuserdatauv(L, sizeof(LFCLayout), 1); // -> [layout]
+    memset(layout, 0, sizeof(LFCLayout));
+    luaL_setmetatable(L, LFC_TYPE_LAYOUT);
+    lua_pushvalue(L, 1);         // -> [layout, font]
+    lua_setiuservalue(L, -2, 1); // -> [layout]
+    if (!(layout->text = malloc(len + 1)))
+        return luaL_error(L, "cannot allocate text layout");
+    memcpy(layout->text, text, len + 1);
+    layout->len = len;
+    layout->tab_offset = get_tab_offset(L, 3);
+    layout_build(L, fc, layout);
+    return 1;
+}
 
-    const char *textp = text, *last_segment = text;
-    int current_font = 0;
-    int first = 1;
+static int f_layout_width(lua_State *L)
+{
+    FcFont *fc;
+    LFCLayout *layout = check_layout(L, 1, &fc);
+    lua_pushnumber(L, layout->width);
+    return 1;
+}
 
-    unsigned int codepoint;
-    while (textp < (text + len))
+static int f_layout_draw(lua_State *L)
+{
+    FcFont *fc;
+    LFCLayout *layout = check_layout(L, 1, &fc);
+    double x = luaL_checknumber(L, 2);
+    double y = luaL_checknumber(L, 3);
+    double clip_right = luaL_optnumber(L, 5, HUGE_VAL);
+    double clip_left = luaL_optnumber(L, 6, -HUGE_VAL);
+    luaL_checktype(L, 4, LUA_TTABLE);
+    for (size_t i = 0; i < layout->nruns; i++)
     {
-        const char *prev_textp = textp;
-        textp = utf8_to_codepoint(textp, &codepoint);
-        if (!FcCharSetHasChar(fc->charsets[current_font], codepoint))
-        {
-            // select a new font
-            int new_font = 0;
-            for (int i = 0; i < fc->n; i++)
-            {
-                int len;
-                const char *name;
-                // skip TTC files because lite-xl don't support them
-                if (FcCharSetHasChar(fc->charsets[i], codepoint) &&
-                    FcPatternGetString(fc->patterns[i], FC_FILE, 0, (unsigned char **) &name) == FcResultMatch &&
-                    (len = strlen(name), strcmp(name + len - 4, ".ttc") != 0))
-                {
-                    new_font = i;
-                    break;
-                }
-            }
-            if (!first)
-            {
-                // process previous font
-                x = draw_text(L, fc, current_font, last_segment, textp - last_segment, x, y, 5);
-            }
-            first = 0;
-            last_segment = prev_textp;
-            current_font = new_font;
-        }
+        LFCRun *run = &layout->runs[i];
+        if (run->blank)
+            x += run->width;
         else
         {
-            continue;
+            draw_clipped(L, fc, run->font, layout->text + run->start, run->end - run->start, x, run->width, y, 4,
+                         clip_left, clip_right);
+            x += run->width;
         }
     }
-    x = draw_text(L, fc, current_font, last_segment, textp - last_segment, x, y, 5);
     lua_pushnumber(L, x);
     return 1;
 }
 
-static int f_copy(lua_State *L)
+static void layout_offsets(lua_State *L, FcFont *fc, LFCLayout *layout, LFCOffsets *offsets)
 {
-    FcFont *font = luaL_checkudata(L, 1, LFC_TYPE_FCFONT);
-    luaL_checknumber(L, 2);
-    // push the base pattern serialized into a string, and call f_load
-    FcChar8 *pattern_str = FcNameUnparse(font->patterns[0]);
-    if (!pattern_str)
-        return luaL_error(L, "cannot unparse base pattern");
-    lua_pushstring(L, (const char *) pattern_str); // -> [font, size, ..., pattern]
-    free(pattern_str);
-    lua_replace(L, 1); // -> [pattern, size, ...]
-    return f_load(L);
+    double x = layout->tab_offset;
+    new_offsets(L, layout->len, offsets); // -> [offsets]
+    add_offset(offsets, layout->text, layout->text, x);
+    for (size_t i = 0; i < layout->nruns; i++)
+    {
+        LFCRun *run = &layout->runs[i];
+        x = piece_offsets(L, fc, run->font, run->blank, layout->text, layout->text + run->start,
+                          layout->text + run->end, x, offsets);
+    }
+}
+
+static int f_layout_get_offsets(lua_State *L)
+{
+    FcFont *fc;
+    LFCOffsets offsets;
+    LFCLayout *layout = check_layout(L, 1, &fc);
+    layout_offsets(L, fc, layout, &offsets);       // -> [offsets]
+    push_offsets(L, &offsets, layout->tab_offset); // -> [offsets, xs, bytes]
+    return 2;
+}
+
+static int f_layout_x_to_byte(lua_State *L)
+{
+    FcFont *fc;
+    LFCOffsets offsets;
+    LFCLayout *layout = check_layout(L, 1, &fc);
+    double x = luaL_checknumber(L, 2);
+    layout_offsets(L, fc, layout, &offsets); // -> [offsets]
+    lua_pushinteger(L, find_offset(&offsets, x + layout->tab_offset));
+    return 1;
+}
+
+static int f_layout_gc(lua_State *L)
+{
+    LFCLayout *layout = luaL_checkudata(L, 1, LFC_TYPE_LAYOUT);
+    free(layout->text);
+    free(layout->runs);
+    memset(layout, 0, sizeof(LFCLayout));
+    return 0;
+}
+
+static int f_set_width_cache(lua_State *L)
+{
+    FcFont *font = check_fcfont(L, 1);
+    lua_Integer capacity = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, capacity >= 0, 2, "capacity must be non-negative");
+    if (width_cache_resize(font, capacity) != 0)
+        return luaL_error(L, "cannot allocate width cache");
+    return 0;
+}
+
+// -> {capacity, count, hits, misses}
+static int f_get_width_cache_stats(lua_State *L)
+{
+    FcFont *font = check_fcfont(L, 1);
+    LFCWidthCache *cache = font->width_cache;
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, cache ? cache->capacity : 0);
+    lua_setfield(L, -2, "capacity");
+    lua_pushinteger(L, cache ? cache->count : 0);
+    lua_setfield(L, -2, "count");
+    lua_pushinteger(L, cache ? cache->hits : 0);
+    lua_setfield(L, -2, "hits");
+    lua_pushinteger(L, cache ? cache->misses : 0);
+    lua_setfield(L, -2, "misses");
+    return 1;
+}
+
+// number of texts measured or drawn, and of the single-font segments they were split into
+static int f_get_segment_stats(lua_State *L)
+{
+    FcFont *font = check_fcfont(L, 1);
+    lua_createtable(L, 0, 4);
+    lua_pushinteger(L, font->texts);
+    lua_setfield(L, -2, "texts");
+    lua_pushinteger(L, font->segments);
+    lua_setfield(L, -2, "segments");
+    lua_pushinteger(L, font->max_segments);
+    lua_setfield(L, -2, "max_segments");
+    lua_pushnumber(L, font->texts ? (double)font->segments / font->texts : 0);
+    lua_setfield(L, -2, "segments_per_text");
+    if (lua_toboolean(L, 2))
+        font->texts = font->segments = font->max_segments = 0;
+    return 1;
+}
+
+static int f_set_width_engine(lua_State *L)
+{
+    static const char *const engines[] = {"native", "renderer", NULL};
+    FcFont *font = check_fcfont(L, 1);
+    font->width_engine = luaL_checkoption(L, 2, NULL, engines);
+    font->generation++;
+    return 0;
+}
+
+static int f_set_fallback_mode(lua_State *L)
+{
+    static const char *const modes[] = {"first", "longest", NULL};
+    FcFont *font = check_fcfont(L, 1);
+    font->fallback_mode = luaL_checkoption(L, 2, NULL, modes);
+    font->generation++;
+    return 0;
 }
 
 static int f_set_tab_size(lua_State *L)
 {
-    FcFont *font = luaL_checkudata(L, 1, LFC_TYPE_FCFONT);
+    FcFont *font = check_fcfont(L, 1);
     font->tab_size = luaL_checkinteger(L, 2);
+    font->generation++;
     return 0;
 }
 
 static int f_get_height(lua_State *L)
 {
-    FcFont *font = luaL_checkudata(L, 1, LFC_TYPE_FCFONT);
-    if (get_function(L, LFC_FONT, "get_height") != 0)
+    FcFont *font = check_fcfont(L, 1);
+    if (get_callback(L, callbacks.get_height) != 0)
         return luaL_error(L, "cannot get renderer.font.get_height()");
     // push the font
-    get_font_cache(L, font->patterns[0]);
+    if (get_font_cache(L, font, 0) != 0)
+        return luaL_error(L, "cannot load font");
     lua_call(L, 1, 1);
     return 1;
 }
 
 static int f_get_size(lua_State *L)
 {
-    FcFont *font = luaL_checkudata(L, 1, LFC_TYPE_FCFONT);
+    FcFont *font = check_fcfont(L, 1);
     double size;
     if (FcPatternGetDouble(font->patterns[0], FC_PIXEL_SIZE, 0, &size) != FcResultMatch)
         return luaL_error(L, "cannot get font size");
@@ -434,85 +3637,189 @@ static int f_get_size(lua_State *L)
 
 static int f_set_size(lua_State *L)
 {
-    FcFont *font = luaL_checkudata(L, 1, LFC_TYPE_FCFONT);
-    double size = luaL_checknumber(L, 2);
-    FcPatternDel(font->base_pattern, FC_PIXEL_SIZE);
-    FcPatternAddDouble(font->base_pattern, FC_PIXEL_SIZE, size);
-    for (int i = 0; i < font->n; i++)
-    {
-        FcPatternDel(font->patterns[i], FC_PIXEL_SIZE);
-        FcPatternAddDouble(font->patterns[i], FC_PIXEL_SIZE, size);
-    }
+    FcFont *font = check_fcfont(L, 1);
+    fcfont_set_size(font, luaL_checknumber(L, 2));
     return 0;
 }
 
 static int f_get_path(lua_State *L)
 {
-    FcFont *font = luaL_checkudata(L, 1, LFC_TYPE_FCFONT);
+    FcFont *font = check_fcfont(L, 1);
     FcChar8 *pattern_str = FcNameUnparse(font->base_pattern);
     lua_pushstring(L, (const char *) pattern_str);
     free(pattern_str);
     return 1;
 }
 
-static int f_clean_font_cache(lua_State *L)
+static int f_gc(lua_State *L)
 {
-    // TODO: fix this
-    int younger_than = luaL_checkinteger(L, 1);
-    int n = luaL_optinteger(L, 2, 1000);
-    if (n > 1000)
-        n = 1000;
-    if (n < 0)
-        n = 0;
+    FcFont *font = luaL_checkudata(L, 1, LFC_TYPE_FCFONT);
+    if (font->job)
+        job_release(font->job);
+    fcfont_free(font);
+    return 0;
+}
 
-    if (lua_getfield(L, LUA_REGISTRYINDEX, LFC_FONT_CACHE) != LUA_TTABLE)
-        return 0;
-    int font_cache = lua_gettop(L);
-    // iterate the cache (do not modify mid iteration)
-    int len = 0;
-    FcChar32 ids[1000];
-    lua_pushnil(L);
-    while (lua_next(L, -2) != 0)
-    {
-        int age = lua_tointeger(L, -1);
-        if (age < younger_than)
-        {
-            ids[len++] = lua_tointeger(L, -2);
-            if (len >= n)
-                break;
-        }
-        lua_pop(L, 1);
-    }
-    // iterate over drop ids and drop the entries
-    for (int i = 0; i < len; i++)
+// returns "pending" until the primary font is known, "partial" until the whole chain is, then "ready"
+static int f_poll(lua_State *L)
+{
+    FcFont *font = luaL_checkudata(L, 1, LFC_TYPE_FCFONT);
+    if (font->job)
+        fcfont_sync(font, 0);
+    if (!font->patterns && font->job && font->job->error)
     {
         lua_pushnil(L);
-        lua_rawseti(L, font_cache, ids[i]);
+        lua_pushfstring(L, "%s: %s", font->job->name, font->job->error);
+        return 2;
+    }
+    lua_pushstring(L, !font->patterns ? "pending" : font->job ? "partial" : "ready");
+    return 1;
+}
+
+// loads a font on a worker thread, the FcFont can be used as soon as its primary font is known
+static int f_load_async(lua_State *L)
+{
+    const char *name = luaL_checkstring(L, 1);
+    LFCLoadJob *job = calloc(1, sizeof(LFCLoadJob));
+    if (!job || !(job->name = strdup(name)))
+    {
+        free(job);
+        return luaL_error(L, "%s: cannot allocate memory", name);
+    }
+    job->has_size = lua_isnumber(L, 2);
+    job->size = lua_tonumber(L, 2);
+    job->refs = 2;
+    lfc_mutex_init(&job->mutex);
+    lfc_cond_init(&job->cond);
+
+    FcFont *font = lua_newuserdata(L, sizeof(FcFont));
+    memset(font, 0, sizeof(FcFont));
+    font->tab_size = -1;
+    font->job = job;
+    luaL_setmetatable(L, LFC_TYPE_FCFONT);
+    if (lfc_thread_start(load_worker, job) != 0)
+    {
+        job->refs--;
+        job->error = "cannot start worker thread";
+        job->state = LFC_JOB_DONE;
+    }
+    return 1;
+}
+
+// evicts fonts that have not been used for max_age seconds, up to max_count fonts
+static int f_clean_font_cache(lua_State *L)
+{
+    double older_than = get_time() - luaL_checknumber(L, 1);
+    lua_Integer n = luaL_optinteger(L, 2, font_cache.count), evicted = 0;
+    LFCCacheEntry *entry = font_cache.oldest, *newer;
+    for (; entry && entry->last_used < older_than && evicted < n; entry = newer)
+    {
+        newer = entry->newer;
+        if (entry->pins == 0)
+        {
+            font_cache_remove(L, entry);
+            evicted++;
+        }
     }
-    lua_rawgeti(L, font_cache, 1);
-    lua_pushinteger(L, lua_tointeger(L, -1) - len);
-    lua_rawseti(L, font_cache, 1);
+    lua_pushinteger(L, evicted);
+    return 1;
+}
+
+static int f_set_chain_cache(lua_State *L)
+{
+    chain_cache_enabled = lua_toboolean(L, 1);
+    return 0;
+}
+
+static int f_set_cache_limits(lua_State *L)
+{
+    lua_Integer max_entries = luaL_checkinteger(L, 1);
+    lua_Number max_bytes = luaL_checknumber(L, 2);
+    luaL_argcheck(L, max_entries >= 0, 1, "must be non-negative");
+    luaL_argcheck(L, max_bytes >= 0, 2, "must be non-negative");
+    font_cache.max_entries = max_entries;
+    font_cache.max_bytes = max_bytes;
+    font_cache_evict(L, 0, 0);
+    return 0;
+}
+
+// with deferred drawing enabled, system font text is queued until flush() is called
+static int f_set_deferred(lua_State *L)
+{
+    draw_queue_flush(L);
+    draw_queue.enabled = lua_toboolean(L, 1);
+    return 0;
+}
+
+static int f_flush(lua_State *L)
+{
+    draw_queue_flush(L);
     return 0;
 }
 
+// counts segments queued, renderer calls they were merged into and flushes since the last reset
+static int f_get_draw_stats(lua_State *L)
+{
+    lua_createtable(L, 0, 4);
+    lua_pushboolean(L, draw_queue.enabled);
+    lua_setfield(L, -2, "deferred");
+    lua_pushinteger(L, draw_queue.segments);
+    lua_setfield(L, -2, "segments");
+    lua_pushinteger(L, draw_queue.calls);
+    lua_setfield(L, -2, "calls");
+    lua_pushinteger(L, draw_queue.flushes);
+    lua_setfield(L, -2, "flushes");
+    if (lua_toboolean(L, 1))
+        draw_queue.segments = draw_queue.calls = draw_queue.flushes = 0;
+    return 1;
+}
+
 static int f_get_cache_metrics(lua_State *L)
 {
-    if (lua_getfield(L, LUA_REGISTRYINDEX, LFC_FONT_CACHE) != LUA_TTABLE)
+    int n = 0;
+    lua_createtable(L, font_cache.count, 4);    // -> [tbl]
+    lua_pushinteger(L, font_cache.count);       // -> [tbl, count]
+    lua_setfield(L, -2, "count");               // -> [tbl]
+    lua_pushinteger(L, font_cache.bytes);       // -> [tbl, bytes]
+    lua_setfield(L, -2, "bytes");               // -> [tbl]
+    lua_pushinteger(L, font_cache.max_entries); // -> [tbl, max_entries]
+    lua_setfield(L, -2, "max_entries");         // -> [tbl]
+    lua_pushinteger(L, font_cache.max_bytes);   // -> [tbl, max_bytes]
+    lua_setfield(L, -2, "max_bytes");           // -> [tbl]
+    // entries are listed from the most to the least recently used
+    for (LFCCacheEntry *entry = font_cache.newest; entry; entry = entry->older)
     {
-        return 0;
-    } // -> [cache]
-    lua_newtable(L); // -> [cache, tbl]
-    lua_pushnil(L);  // -> [cache, tbl, nil]
-    while (lua_next(L, -3) != 0)
-    {                         // -> [cache, tbl, key, value]
-        lua_pushvalue(L, -2); // -> [cache, tbl, key, value, key]
-        lua_pushvalue(L, -2); // -> [cache, tbl, key, value, key, value]
-        lua_rawset(L, -5);    // -> [cache, tbl, key, value]
-        lua_pop(L, 1);        // -> [cache, tbl, key]
-    } // -> [cache, tbl]
+        lua_createtable(L, 0, 7);                         // -> [tbl, entry]
+        lua_pushstring(L, entry->file);                   // -> [tbl, entry, file]
+        lua_setfield(L, -2, "file");                      // -> [tbl, entry]
+        lua_pushinteger(L, entry->index);                 // -> [tbl, entry, index]
+        lua_setfield(L, -2, "index");                     // -> [tbl, entry]
+        lua_pushnumber(L, entry->size);                   // -> [tbl, entry, size]
+        lua_setfield(L, -2, "size");                      // -> [tbl, entry]
+        lua_pushinteger(L, entry->bytes);                 // -> [tbl, entry, bytes]
+        lua_setfield(L, -2, "bytes");                     // -> [tbl, entry]
+        lua_pushboolean(L, entry->pins > 0);              // -> [tbl, entry, pinned]
+        lua_setfield(L, -2, "pinned");                    // -> [tbl, entry]
+        lua_pushnumber(L, get_time() - entry->last_used); // -> [tbl, entry, age]
+        lua_setfield(L, -2, "age");                       // -> [tbl, entry]
+        lua_rawgeti(L, LUA_REGISTRYINDEX, entry->ref);    // -> [tbl, entry, font]
+        lua_setfield(L, -2, "font");                      // -> [tbl, entry]
+        lua_rawseti(L, -2, ++n);                          // -> [tbl]
+    }
     return 1;
 }
 
+// resolves the renderer functions again, for hosts that replace them after setup()
+static int f_rebind(lua_State *L)
+{
+    bind_callback(L, &callbacks.draw_text, LFC_RENDERER, "draw_text");
+    bind_callback(L, &callbacks.get_width, LFC_FONT, "get_width");
+    bind_callback(L, &callbacks.get_height, LFC_FONT, "get_height");
+    bind_callback(L, &callbacks.load, LFC_FONT, "load");
+    bind_callback(L, &callbacks.group, LFC_FONT, "group");
+    return 0;
+}
+
 static int f_setup(lua_State *L)
 {
 #ifdef FONTCONFIG_DYNAMIC
@@ -525,26 +3832,66 @@ static int f_setup(lua_State *L)
     lua_settop(L, 2);
     lua_setfield(L, LUA_REGISTRYINDEX, LFC_FONT);
     lua_setfield(L, LUA_REGISTRYINDEX, LFC_RENDERER);
-    return 0;
+    return f_rebind(L);
 }
 
 static luaL_Reg fc_meta[] = {
     {"get_width", f_get_width},
+    {"get_widths", f_get_widths},
+    {"get_widths_async", f_get_widths_async},
+    {"get_offsets", f_get_offsets},
+    {"x_to_byte", f_x_to_byte},
+    {"layout", f_layout},
     {"get_height", f_get_height},
     {"get_size", f_get_size},
     {"set_size", f_set_size},
     {"get_path", f_get_path},
     {"copy", f_copy},
+    {"to_group", f_to_group},
     {"set_tab_size", f_set_tab_size},
+    {"set_width_engine", f_set_width_engine},
+    {"set_fallback_mode", f_set_fallback_mode},
+    {"set_width_cache", f_set_width_cache},
+    {"get_width_cache_stats", f_get_width_cache_stats},
+    {"get_segment_stats", f_get_segment_stats},
+    {"poll", f_poll},
+    {"__gc", f_gc},
+    {"__close", f_gc},
+    {NULL, NULL},
+};
+
+static luaL_Reg layout_meta[] = {
+    {"width", f_layout_width},
+    {"draw", f_layout_draw},
+    {"get_offsets", f_layout_get_offsets},
+    {"x_to_byte", f_layout_x_to_byte},
+    {"__gc", f_layout_gc},
+    {NULL, NULL},
+};
+
+static luaL_Reg width_job_meta[] = {
+    {"progress", f_width_job_progress},
+    {"results", f_width_job_results},
+    {"wait", f_width_job_wait},
+    {"cancel", f_width_job_cancel},
+    {"__gc", f_width_job_gc},
     {NULL, NULL},
 };
 
 static luaL_Reg lib[] = {
     {"setup", f_setup},
+    {"rebind", f_rebind},
     {"load", f_load},
+    {"load_async", f_load_async},
     {"draw_text", f_draw_text},
+    {"draw_batch", f_draw_batch},
     {"clean_font_cache", f_clean_font_cache},
+    {"set_cache_limits", f_set_cache_limits},
+    {"set_chain_cache", f_set_chain_cache},
     {"get_cache_metrics", f_get_cache_metrics},
+    {"set_deferred", f_set_deferred},
+    {"flush", f_flush},
+    {"get_draw_stats", f_get_draw_stats},
     {NULL, NULL},
 };
 
@@ -554,6 +3901,14 @@ LFC_EXPORT int luaopen_systemfonts(lua_State *L)
     luaL_setfuncs(L, fc_meta, 0);
     lua_pushvalue(L, -1);
     lua_setfield(L, -2, "__index");
+    luaL_newmetatable(L, LFC_TYPE_LAYOUT);
+    luaL_setfuncs(L, layout_meta, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_newmetatable(L, LFC_TYPE_WIDTH_JOB);
+    luaL_setfuncs(L, width_job_meta, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
     luaL_newlib(L, lib);
     return 1;
 }
@@ -1,10 +1,65 @@
 --mod-version:3
 
+local core = require "core"
+local common = require "core.common"
+local config = require "core.config"
 local systemfonts = require "libraries.systemfonts"
 
+config.plugins.systemfonts = common.merge({
+  -- maximum number of renderer fonts kept loaded
+  max_fonts = 64,
+  -- maximum total size of the font files kept loaded, in bytes
+  max_font_bytes = 256 * 1024 * 1024,
+  -- fonts unused for this many seconds are unloaded
+  font_max_age = 300,
+  -- cache resolved fallback chains on disk to speed up startup
+  chain_cache = true,
+  -- queue text drawn with system fonts and merge it into fewer renderer calls per frame
+  deferred_draw = false,
+}, config.plugins.systemfonts)
+
 local r = { draw_text = renderer.draw_text }
 
 systemfonts.setup(r, renderer.font)
+systemfonts.set_chain_cache(config.plugins.systemfonts.chain_cache)
 renderer.draw_text = systemfonts.draw_text
 
-return systemfonts
\ No newline at end of file
+-- queued text has to reach the renderer before anything is drawn over it,
+-- the wrappers are only installed while deferred drawing is on so that direct drawing pays nothing
+local unwrapped, wrapped = {}, {}
+for _, name in ipairs { "draw_rect", "set_clip_rect", "draw_canvas", "draw_poly", "end_frame" } do
+  local fn = renderer[name]
+  if fn then
+    unwrapped[name] = fn
+    wrapped[name] = function(...)
+      systemfonts.flush()
+      return fn(...)
+    end
+  end
+end
+
+local set_deferred = systemfonts.set_deferred
+function systemfonts.set_deferred(enabled)
+  set_deferred(enabled)
+  local from, to = enabled and unwrapped or wrapped, enabled and wrapped or unwrapped
+  for name, fn in pairs(to) do
+    -- leave functions that another plugin replaced since alone
+    if renderer[name] == from[name] then
+      renderer[name] = fn
+    end
+  end
+end
+
+systemfonts.set_deferred(config.plugins.systemfonts.deferred_draw)
+
+core.add_thread(function()
+  while true do
+    local conf = config.plugins.systemfonts
+    systemfonts.set_cache_limits(conf.max_fonts, conf.max_font_bytes)
+    systemfonts.clean_font_cache(conf.font_max_age)
+    systemfonts.set_deferred(conf.deferred_draw)
+    coroutine.yield(60)
+  end
+end)
+
+return systemfonts
@@ -0,0 +1,127 @@
+// Compares the "first" and "longest" fallback modes on lines that mix ASCII words with words
+// that only some fonts of the chain can draw. Every segment is a renderer call when the text
+// is drawn, so segments per line stand for the draw cost; the times are those of splitting
+// the lines and of measuring them natively.
+#include "harness.h"
+
+#define LINES 20000
+#define REPEAT 10
+#define CLASS_FONTS 8 // fonts of the chain that tell coverage classes apart
+#define CLASS_SIZE 1024
+
+typedef struct
+{
+    unsigned mask; // fonts that have the codepoints
+    int n;
+    unsigned codepoints[CLASS_SIZE];
+} CoverageClass;
+
+static char lines[LINES][12 * 7 * 4];
+static size_t lengths[LINES];
+
+// groups codepoints by the set of fonts that have them, words are made from a single group
+static int coverage_classes(FcFont *font, CoverageClass *classes)
+{
+    static CoverageClass by_mask[1 << CLASS_FONTS];
+    int fonts = font->n < CLASS_FONTS ? font->n : CLASS_FONTS, n = 0;
+    for (unsigned c = 0xA0; c < 0x30000; c++)
+    {
+        unsigned mask = 0;
+        // combining marks and other characters that join clusters would blur the words
+        if (lfc_grapheme_props(c) != LFC_GCB_OTHER)
+            continue;
+        for (int i = 0; i < fonts; i++)
+        {
+            if (FcCharSetHasChar(fcfont_charset(font, i), c) && fcfont_loadable(font, i))
+                mask |= 1u << i;
+        }
+        if (mask && by_mask[mask].n < CLASS_SIZE)
+            by_mask[mask].codepoints[by_mask[mask].n++] = c;
+    }
+    for (unsigned mask = 1; mask < 1u << fonts; mask++)
+    {
+        if (by_mask[mask].n)
+        {
+            classes[n] = by_mask[mask];
+            classes[n++].mask = mask;
+        }
+    }
+    return n;
+}
+
+static void make_lines(CoverageClass *classes, int nclasses)
+{
+    unsigned seed = 9;
+    for (int l = 0; l < LINES; l++)
+    {
+        size_t len = 0;
+        int words = 1 + harness_random(&seed) % 12;
+        for (int w = 0; w < words; w++)
+        {
+            int chars = 1 + harness_random(&seed) % 6;
+            CoverageClass *class = harness_random(&seed) % 2 ? &classes[harness_random(&seed) % nclasses] : NULL;
+            for (int c = 0; c < chars; c++)
+            {
+                unsigned codepoint = class ? class->codepoints[harness_random(&seed) % class->n] : 'a' + harness_random(&seed) % 26;
+                len += utf8_encode(lines[l] + len, codepoint);
+            }
+            lines[l][len++] = ' ';
+        }
+        lengths[l] = len;
+    }
+}
+
+int main(void)
+{
+    static CoverageClass classes[1 << CLASS_FONTS];
+    FcFont *font;
+    int nclasses;
+
+    if (!harness_init() || !(font = harness_load("monospace", 14)))
+        return HARNESS_SKIP;
+    if ((nclasses = coverage_classes(font, classes)) < 2)
+    {
+        fprintf(stderr, "the chain has a single coverage class, there is nothing to choose from\n");
+        return HARNESS_SKIP;
+    }
+    make_lines(classes, nclasses);
+    printf("%d fonts, %d coverage classes, %d lines\n", font->n, nclasses, LINES);
+
+    for (int mode = LFC_FALLBACK_FIRST; mode <= LFC_FALLBACK_LONGEST; mode++)
+    {
+        size_t segments = 0, max_segments = 0;
+        double start, segment_time, width_time, sum = 0;
+        font->fallback_mode = mode;
+
+        start = get_time();
+        for (int r = 0; r < REPEAT; r++)
+        {
+            for (int l = 0; l < LINES; l++)
+            {
+                const char *p = lines[l], *end = lines[l] + lengths[l];
+                int current_font = 0;
+                size_t n = 0;
+                for (; p < end; n++)
+                    p = next_segment(font, p, end, &current_font);
+                segments += n;
+                max_segments = n > max_segments ? n : max_segments;
+            }
+        }
+        segment_time = (get_time() - start) / REPEAT / LINES;
+
+        for (int l = 0; l < LINES; l++)
+            text_width(NULL, font, lines[l], lengths[l], 0); // loads the advances
+        start = get_time();
+        for (int r = 0; r < REPEAT; r++)
+        {
+            for (int l = 0; l < LINES; l++)
+                sum += text_width(NULL, font, lines[l], lengths[l], 0);
+        }
+        width_time = (get_time() - start) / REPEAT / LINES;
+
+        printf("%-7s: segments/line %.3f, max %zu, segmentation %.2f us/line, get_width %.2f us/line (total %g)\n",
+               mode == LFC_FALLBACK_LONGEST ? "longest" : "first", (double)segments / REPEAT / LINES, max_segments,
+               segment_time * 1e6, width_time * 1e6, sum / REPEAT);
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+// Measures how fast ASCII source lines are split into segments and measured in a monospaced
+// chain, with the ASCII prescan and with a lookup per codepoint. meson builds it once per
+// prescan variant: AVX2, SSE2 and the 8-byte word fallback.
+#include "harness.h"
+
+#define LINES 1000000
+
+#if defined(__AVX2__)
+#define PRESCAN "AVX2"
+#elif defined(__SSE2__)
+#define PRESCAN "SSE2"
+#else
+#define PRESCAN "SWAR"
+#endif
+
+static const char *const source[] = {
+    "    for (int i = 0; i < set->nfont; i++)",
+    "        font->patterns[i] = FcFontRenderPrepare(NULL, base_pattern, set->fonts[i]);",
+    "local systemfonts = require \"libraries.systemfonts\" -- load the native module",
+    "    return coverage->blocks[coverage->stage1[codepoint / LFC_COVERAGE_BLOCK]][codepoint % LFC_COVERAGE_BLOCK];",
+    "\tif (fc->covered < fc->n && first == LFC_COVERAGE_NONE)",
+    "  core.add_thread(function() while true do coroutine.yield(60) end end)",
+    "}",
+    "",
+};
+
+static double bench_segments(FcFont *font, size_t *segments)
+{
+    double start = get_time();
+    *segments = 0;
+    for (int i = 0; i < LINES; i++)
+    {
+        const char *line = source[i % (sizeof(source) / sizeof(*source))];
+        const char *p = line, *end = line + strlen(line);
+        int current_font = 0;
+        while (p < end)
+        {
+            p = next_segment(font, p, end, &current_font);
+            (*segments)++;
+        }
+    }
+    return (get_time() - start) * 1e9 / LINES;
+}
+
+static double bench_widths(FcFont *font, double *sum)
+{
+    double start = get_time();
+    *sum = 0;
+    for (int i = 0; i < LINES; i++)
+    {
+        const char *line = source[i % (sizeof(source) / sizeof(*source))];
+        *sum += text_width(NULL, font, line, strlen(line), 0);
+    }
+    return (get_time() - start) * 1e9 / LINES;
+}
+
+int main(void)
+{
+    FcFont *font;
+    size_t segments;
+    double segment_time, width_time, sum;
+
+#if defined(__AVX2__) && defined(__GNUC__)
+    if (!__builtin_cpu_supports("avx2"))
+        return HARNESS_SKIP;
+#endif
+    if (!harness_init() || !(font = harness_load("monospace", 14)))
+        return HARNESS_SKIP;
+    if (!font->ascii_primary)
+    {
+        fprintf(stderr, "the primary font does not cover ASCII, the prescan is never used\n");
+        return HARNESS_SKIP;
+    }
+    // every ASCII character goes through the coverage table without the prescan
+    for (int ascii_primary = 0; ascii_primary <= 1; ascii_primary++)
+    {
+        font->ascii_primary = ascii_primary;
+        segment_time = bench_segments(font, &segments);
+        width_time = bench_widths(font, &sum);
+        printf("%s, %s: segmentation %.1f ns/line (%zu segments), get_width %.1f ns/line (total %g)\n",
+               PRESCAN, ascii_primary ? "prescan" : "lookup", segment_time, segments, width_time, sum);
+    }
+    return 0;
+}
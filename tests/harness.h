@@ -0,0 +1,141 @@
+// Helpers shared by the tests and benchmarks. They build the plugin source into themselves to
+// reach its static functions, and stand in for the renderer with FreeType faces, so no Lua
+// state is involved: every function that takes one is only called on its native paths.
+#ifndef LFC_HARNESS_H
+#define LFC_HARNESS_H
+
+#include "systemfonts.c"
+
+#include <stdio.h>
+
+// exit code that meson reports as a skipped test
+#define HARNESS_SKIP 77
+
+// loads fontconfig and FreeType, returns 0 if they are not available
+static inline int harness_init(void)
+{
+#ifdef FONTCONFIG_DYNAMIC
+    // this initializes fontconfig as well
+    const char *error = load_fontconfig();
+    if (error)
+    {
+        fprintf(stderr, "%s\n", error);
+        return 0;
+    }
+#else
+    if (!FcInit())
+    {
+        fprintf(stderr, "cannot initialize fontconfig\n");
+        return 0;
+    }
+#endif
+    if (!ft_init())
+    {
+        fprintf(stderr, "cannot initialize FreeType\n");
+        return 0;
+    }
+    return 1;
+}
+
+// deterministic across platforms, unlike rand()
+static inline unsigned harness_random(unsigned *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+// returns the file of the font that fontconfig picks for a name, or NULL
+static inline char *harness_match_file(const char *name)
+{
+    const char *error;
+    FcResult result;
+    FcChar8 *file;
+    char *copy = NULL;
+    FcPattern *pattern = get_base_pattern(name, 0, 0, &error), *match;
+    if (!pattern)
+        return NULL;
+    match = FcFontMatch(NULL, pattern, &result);
+    if (match && FcPatternGetString(match, FC_FILE, 0, &file) == FcResultMatch)
+        copy = strdup((const char *)file);
+    if (match)
+        FcPatternDestroy(match);
+    FcPatternDestroy(pattern);
+    return copy;
+}
+
+// opens a face the way the renderer opens its fonts, with the advances that lite-xl 2.1 uses
+static inline LFCFace *harness_face(const char *file, int size, int options)
+{
+    LFCFace *face = calloc(1, sizeof(LFCFace));
+    if (!face)
+        return NULL;
+    if (FT_New_Face(ft_library, file, 0, &face->face) != 0)
+    {
+        face->face = NULL;
+        goto fail;
+    }
+    if (FT_Set_Pixel_Sizes(face->face, 0, size) != 0 || !(face->pages = calloc(sizeof(float *), LFC_ADVANCE_PAGES)))
+        goto fail;
+    face->load_flags = face_load_flags(options);
+    face->deltas = 1;
+    face->space_advance = face_glyph_advance(face, ' ', 1);
+    if (face->space_advance == LFC_ADVANCE_MISSING)
+        face->space_advance = 0;
+    face->tab_advance = face->space_advance * 2;
+    face_init_cells(face);
+    return face;
+fail:
+    face_free(face);
+    return NULL;
+}
+
+// loads the whole fallback chain of a font name, with a native face for every font in it
+// so that widths never need the renderer
+static inline FcFont *harness_load(const char *name, int size)
+{
+    const char *error;
+    FcResult result;
+    FcFontSet *set;
+    FcFont *font = calloc(1, sizeof(FcFont));
+    FcPattern *pattern = get_base_pattern(name, 1, size, &error);
+    if (!font || !pattern || !(set = FcFontSort(NULL, pattern, 1, NULL, &result)) || set->nfont == 0)
+        goto fail;
+    if ((error = fcfont_init(font, pattern, set)) || fcfont_extend_all(font) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", name, error ? error : "cannot build coverage table");
+        free(font);
+        return NULL;
+    }
+    font->width_engine = LFC_WIDTH_NATIVE;
+    font->entries_generation = font_cache.generation;
+    for (int i = 0; i < font->n; i++)
+    {
+        LFCCacheEntry *entry = calloc(1, sizeof(LFCCacheEntry));
+        FcPattern *prepared = fcfont_pattern(font, i);
+        FcChar8 *file;
+        if (!entry || !prepared || FcPatternGetString(prepared, FC_FILE, 0, &file) != FcResultMatch)
+        {
+            fprintf(stderr, "%s: cannot prepare font %d\n", name, i);
+            return NULL;
+        }
+        entry->file = strdup((const char *)file);
+        entry->size = size;
+        entry->options = get_render_options(prepared);
+        if (!(entry->face = harness_face(entry->file, size, entry->options)))
+        {
+            fprintf(stderr, "%s: cannot open %s\n", name, entry->file);
+            return NULL;
+        }
+        entry->face_state = LFC_FACE_NATIVE;
+        font->entries[i] = entry;
+    }
+    return font;
+fail:
+    fprintf(stderr, "%s: cannot load font\n", name);
+    if (pattern)
+        FcPatternDestroy(pattern);
+    free(font);
+    return NULL;
+}
+
+#endif
@@ -0,0 +1,169 @@
+// Compares the native widths of face_measure() with a model of lite-xl 2.1's renderer
+// (font_load_glyphset() and ren_font_group_get_width() in renderer.c) over random text.
+#include "harness.h"
+
+#define REF_SETS (0x110000 >> 8)
+
+typedef struct
+{
+    FT_Face face;
+    int load_flags, render_mode;
+    float space_advance;
+    float *advances[REF_SETS];
+    unsigned char *loaded[REF_SETS];
+} RefFont;
+
+// the renderer defaults to subpixel antialiasing and slight hinting
+static void ref_flags(RefFont *font, int options)
+{
+    int aa = options & LFC_AA_MASK ? options & LFC_AA_MASK : LFC_AA_SUBPIXEL;
+    int hint = options & LFC_HINT_MASK ? options & LFC_HINT_MASK : LFC_HINT_SLIGHT;
+    if (aa == LFC_AA_NONE)
+        font->load_flags = FT_LOAD_TARGET_MONO;
+    else
+        font->load_flags = hint == LFC_HINT_SLIGHT ? FT_LOAD_TARGET_LIGHT : FT_LOAD_TARGET_NORMAL;
+    font->load_flags |= hint == LFC_HINT_NONE ? FT_LOAD_NO_HINTING : FT_LOAD_FORCE_AUTOHINT;
+    if (aa == LFC_AA_NONE)
+        font->render_mode = FT_RENDER_MODE_MONO;
+    else if (aa == LFC_AA_SUBPIXEL)
+        font->render_mode = FT_RENDER_MODE_LCD;
+    else
+        font->render_mode = hint == LFC_HINT_SLIGHT ? FT_RENDER_MODE_LIGHT : FT_RENDER_MODE_NORMAL;
+}
+
+// loads the glyph set of a codepoint, a glyph only counts as loaded if it can be rendered
+static int ref_set(RefFont *font, unsigned codepoint)
+{
+    int set = codepoint >> 8;
+    if (font->advances[set])
+        return set;
+    font->advances[set] = calloc(256, sizeof(float));
+    font->loaded[set] = calloc(256, 1);
+    for (unsigned i = 0; i < 256; i++)
+    {
+        FT_UInt glyph = FT_Get_Char_Index(font->face, (set << 8) | i);
+        if (!glyph || FT_Load_Glyph(font->face, glyph, font->load_flags | FT_LOAD_BITMAP_METRICS_ONLY) != 0 ||
+            FT_Render_Glyph(font->face->glyph, font->render_mode) != 0)
+            continue;
+        FT_GlyphSlot slot = font->face->glyph;
+        font->advances[set][i] = (slot->advance.x + slot->lsb_delta - slot->rsb_delta) / 64.0f;
+        font->loaded[set][i] = 1;
+    }
+    if (set == 0)
+    {
+        font->space_advance = font->advances[0][' '];
+        font->advances[0]['\t'] = font->space_advance * 2;
+    }
+    return set;
+}
+
+static double ref_width(RefFont *font, const char *str, size_t len)
+{
+    const char *p = str, *end = str + len;
+    double width = 0;
+    ref_set(font, 0);
+    while (p < end)
+    {
+        unsigned codepoint;
+        p = utf8_decode(p, end, &codepoint);
+        int set = ref_set(font, codepoint);
+        if (!font->loaded[set][codepoint & 0xFF] && codepoint > 0xFF && codepoint != 0x25A1)
+            set = ref_set(font, codepoint = 0x25A1);
+        float advance = font->advances[set][codepoint & 0xFF];
+        width += advance ? advance : font->space_advance;
+    }
+    return width;
+}
+
+static void ref_free(RefFont *font)
+{
+    for (int i = 0; i < REF_SETS; i++)
+    {
+        free(font->advances[i]);
+        free(font->loaded[i]);
+    }
+    FT_Done_Face(font->face);
+}
+
+// ASCII, tabs, Latin and other alphabets, symbols and combining marks
+static size_t random_text(unsigned *seed, char *buf)
+{
+    size_t len = 0;
+    int n = 1 + harness_random(seed) % 60;
+    for (int i = 0; i < n; i++)
+    {
+        unsigned codepoint, kind = harness_random(seed) % 10;
+        if (kind < 5)
+            codepoint = 0x20 + harness_random(seed) % 0x5F;
+        else if (kind < 6)
+            codepoint = '\t';
+        else if (kind < 8)
+            codepoint = 0x80 + harness_random(seed) % 0x700;
+        else if (kind < 9)
+            codepoint = 0x2000 + harness_random(seed) % 0x1000;
+        else
+            codepoint = 0x300 + harness_random(seed) % 0x70;
+        len += utf8_encode(buf + len, codepoint);
+    }
+    return len;
+}
+
+int main(void)
+{
+    static const char *const names[] = {"sans", "monospace", "serif:bold"};
+    static const int options[] = {
+        LFC_AA_SUBPIXEL | LFC_HINT_SLIGHT,
+        LFC_AA_GRAYSCALE | LFC_HINT_FULL,
+        LFC_AA_NONE | LFC_HINT_NONE,
+        0,
+    };
+    unsigned seed = 1;
+    long strings = 0, mismatches = 0;
+    char buf[60 * 4];
+
+    if (!harness_init())
+        return HARNESS_SKIP;
+    for (int n = 0; n < sizeof(names) / sizeof(*names); n++)
+    {
+        char *file = harness_match_file(names[n]);
+        if (!file)
+        {
+            fprintf(stderr, "no font for %s\n", names[n]);
+            return HARNESS_SKIP;
+        }
+        for (int o = 0; o < sizeof(options) / sizeof(*options); o++)
+        {
+            for (int size = 9; size <= 24; size += 5)
+            {
+                RefFont ref = {0};
+                LFCFace *face = harness_face(file, size, options[o]);
+                if (!face || FT_New_Face(ft_library, file, 0, &ref.face) != 0 || FT_Set_Pixel_Sizes(ref.face, 0, size) != 0)
+                {
+                    fprintf(stderr, "cannot open %s\n", file);
+                    return 1;
+                }
+                ref_flags(&ref, options[o]);
+                for (int i = 0; i < 3000; i++)
+                {
+                    size_t len = random_text(&seed, buf);
+                    double expected = ref_width(&ref, buf, len), width;
+                    // the monospace path counts ASCII characters instead of adding their advances
+                    for (int monospace = 0; monospace <= 1; monospace++)
+                    {
+                        strings++;
+                        if (face_measure(face, buf, len, monospace, &width) == 0 && width == expected)
+                            continue;
+                        if (mismatches++ < 10)
+                            printf("%s, options %d, size %d, monospace %d: \"%.*s\" is %g wide, expected %g\n",
+                                   file, options[o], size, monospace, (int)len, buf, width, expected);
+                    }
+                }
+                face_free(face);
+                ref_free(&ref);
+            }
+        }
+        free(file);
+    }
+    printf("%ld strings, %ld mismatches\n", strings, mismatches);
+    return mismatches != 0;
+}